@@ -23,18 +23,21 @@ private:
   };
 
   static constexpr element_slot ELEM_TOMB = static_cast<element_slot>(-1);
-  static constexpr element_slot ELEM_ACTIVE = ELEM_TOMB - 1;
-  static_assert(MaxElems < ELEM_ACTIVE, "Invalid max element count");
+  static_assert(MaxElems < ELEM_TOMB, "Invalid max element count");
+
+  static constexpr size_t BITMAP_WORDS = (MaxElems + 63) / 64;
 
 public:
-  FixedFreelist() noexcept : _empty_head(0), _count(0) {
-    memset(_slots, 0xFF, sizeof(_slots)); // Sets every slot to ELEM_TOMB
+  // Slots are handed out from a bump index first, so nothing in _slots needs initialization
+  FixedFreelist() noexcept : _empty_head(ELEM_TOMB), _bump(0), _count(0) {
+    memset(_occupied, 0x00, sizeof(_occupied));
   }
 
   FixedFreelist(FixedFreelist&& other) noexcept(meta::nothrow_move_constructible<T>)
   requires(!meta::trivially_move_constructible<T>)
-      : _count(other._count), _empty_head(other._empty_head) {
+      : _empty_head(other._empty_head), _bump(other._bump), _count(other._count) {
     memcpy(_slots, other._slots, sizeof(_slots));
+    memcpy(_occupied, other._occupied, sizeof(_occupied));
     other.for_each([this](value_type& elem, element_slot slot) {
       NTF_PNEW(reinterpret_cast<T*>(_slots[slot].elem)) T(::ntf::move(elem));
     });
@@ -46,8 +49,9 @@ public:
 
   FixedFreelist(const FixedFreelist& other) noexcept(meta::nothrow_copy_constructible<T>)
   requires(!meta::trivially_copy_constructible<T>)
-      : _count(other._count), _empty_head(other._empty_head) {
+      : _empty_head(other._empty_head), _bump(other._bump), _count(other._count) {
     memcpy(_slots, other._slots, sizeof(_slots));
+    memcpy(_occupied, other._occupied, sizeof(_occupied));
     other.for_each([this](const value_type& elem, element_slot slot) {
       NTF_PNEW(reinterpret_cast<T*>(_slots[slot].elem)) T(elem);
     });
@@ -89,59 +93,74 @@ private:
   template<typename... Args>
   element_slot _do_insert(Args&&... args) {
     NTF_ASSERT(_count < MaxElems);
-    element_slot pos = _empty_head;
-    NTF_ASSERT(pos < MaxElems);
-
-    auto& slot = _slots[pos];
-    NTF_ASSERT(slot.next != ELEM_ACTIVE);
-    if (slot.next == ELEM_TOMB) {
-      ++_empty_head;
+    element_slot pos;
+    if (_empty_head != ELEM_TOMB) {
+      pos = _empty_head;
+      _empty_head = _slots[pos].next;
     } else {
-      _empty_head = slot.next;
+      pos = _bump++;
     }
+    NTF_ASSERT(pos < MaxElems);
+    NTF_ASSERT(!has_element(pos));
 
-    new (reinterpret_cast<T*>(slot.elem)) T(::ntf::forward<Args>(args)...);
-    slot.next = ELEM_ACTIVE;
+    new (reinterpret_cast<T*>(_slots[pos].elem)) T(::ntf::forward<Args>(args)...);
+    _occupied[pos / 64] |= u64(1) << (pos % 64);
 
     ++_count;
     return pos;
   }
 
   void _do_remove(element_slot pos) {
-    auto& slot = _slots[pos];
-    NTF_ASSERT(slot.next == ELEM_ACTIVE);
+    NTF_ASSERT(has_element(pos));
     if constexpr (!meta::trivially_destructible<T>) {
       _elem_at(pos).~T();
     }
+    _occupied[pos / 64] &= ~(u64(1) << (pos % 64));
 
-    slot.next = _empty_head;
+    _slots[pos].next = _empty_head;
     _empty_head = pos;
 
     --_count;
   }
 
 public:
+  // Jumps between live slots using the occupancy bitmap
   template<typename F>
   void for_each(F&& f) {
-    for (element_slot pos = 0, i = 0; pos < _count && i < (element_slot)MaxElems; ++i) {
-      if (_slots[i].next == ELEM_ACTIVE) {
-        if constexpr (meta::invocable_with<meta::remove_cvref_t<F>, decltype(_slots[i].elem),
-                                           element_slot>) {
+    const size_t words = (_bump + 63) / 64;
+    for (size_t w = 0; w < words; ++w) {
+      u64 bits = _occupied[w];
+      while (bits) {
+        const element_slot i = static_cast<element_slot>(w * 64 + __builtin_ctzll(bits));
+        bits &= bits - 1;
+        if constexpr (meta::invocable_with<meta::remove_cvref_t<F>, T&, element_slot>) {
           f(_elem_at(i), i);
         } else {
           f(_elem_at(i));
         }
-        ++pos;
       }
     }
   }
 
+  template<typename F>
+  void for_each(F&& f) const {
+    const_cast<FixedFreelist&>(*this).for_each([&f](const T& elem, element_slot slot) {
+      if constexpr (meta::invocable_with<meta::remove_cvref_t<F>, const T&, element_slot>) {
+        f(elem, slot);
+      } else {
+        f(elem);
+      }
+    });
+  }
+
+  // Only the part of the bitmap that was ever used gets touched
   void clear() {
     if constexpr (!meta::trivially_destructible<T>) {
       for_each([](T& elem) { elem.~T(); });
     }
-    memset(_slots, 0xFF, sizeof(_slots));
-    _empty_head = 0;
+    memset(_occupied, 0x00, ((_bump + 63) / 64) * sizeof(u64));
+    _empty_head = ELEM_TOMB;
+    _bump = 0;
     _count = 0;
   }
 
@@ -153,7 +172,7 @@ public:
   bool empty() const noexcept { return size() == 0; }
 
   bool has_element(element_slot slot) const noexcept {
-    return slot < MaxElems && _slots[slot].next == ELEM_ACTIVE;
+    return slot < MaxElems && (_occupied[slot / 64] >> (slot % 64)) & 1u;
   }
 
   const value_type& operator[](element_slot slot) const {
@@ -162,7 +181,7 @@ public:
   }
 
   value_type& operator[](element_slot slot) {
-    return const_cast<value_type&>(as_const(*this)[slot]);
+    return const_cast<value_type&>(::ntf::as_const(*this)[slot]);
   }
 
   const value_type& at(element_slot slot) const {
@@ -170,29 +189,832 @@ public:
     return _elem_at(slot);
   }
 
-  value_type& at(element_slot slot) { return const_cast<value_type&>(as_const(*this).at(slot)); }
+  value_type& at(element_slot slot) {
+    return const_cast<value_type&>(::ntf::as_const(*this).at(slot));
+  }
 
   const value_type* at_opt(element_slot slot) const noexcept {
     return has_element(slot) ? &_elem_at(slot) : nullptr;
   }
 
   value_type* at_opt(element_slot slot) noexcept {
-    return const_cast<value_type*>(as_const(*this).at_opt(slot));
+    return const_cast<value_type*>(::ntf::as_const(*this).at_opt(slot));
   }
 
 private:
   const T& _elem_at(element_slot slot) const {
-    return *launder(reinterpret_cast<const T*>(&_slots[slot].elem));
+    return *::ntf::launder(reinterpret_cast<const T*>(&_slots[slot].elem));
   }
 
-  T& _elem_at(element_slot slot) { return const_cast<T&>(as_const(*this)._elem_at(slot)); }
+  T& _elem_at(element_slot slot) { return const_cast<T&>(::ntf::as_const(*this)._elem_at(slot)); }
 
 private:
   slot_t _slots[MaxElems];
+  u64 _occupied[BITMAP_WORDS];
   element_slot _empty_head;
+  u32 _bump; // Slots at or past this index were never used
   u32 _count;
 };
 
+// Growable version of FixedFreelist. Slots live in fixed size chunks taken from the allocator, so
+// growing never moves existing elements
+template<typename T, typename Alloc = DefaultAlloc<T>, size_t ChunkElems = 256>
+class Freelist : private Alloc {
+public:
+  static constexpr size_t chunk_element_count = ChunkElems;
+  using value_type = T;
+  using element_slot = FreelistSlot;
+  using allocator_type = Alloc;
+
+private:
+  static_assert(ChunkElems > 0 && ChunkElems % 64 == 0, "ChunkElems has to be a multiple of 64");
+
+  struct slot_t {
+    alignas(T) u8 elem[sizeof(T)];
+    u32 next;
+  };
+
+  struct chunk_t {
+    u64 occupied[ChunkElems / 64];
+    slot_t slots[ChunkElems];
+  };
+
+  using chunk_alloc = typename Alloc::template rebind<chunk_t>;
+  using table_alloc = typename Alloc::template rebind<chunk_t*>;
+
+  static constexpr element_slot ELEM_TOMB = static_cast<element_slot>(-1);
+
+public:
+  Freelist() noexcept(meta::nothrow_default_constructible<Alloc>) : Alloc() {}
+
+  explicit Freelist(const Alloc& alloc) noexcept(meta::nothrow_copy_constructible<Alloc>) :
+      Alloc(alloc) {}
+
+  Freelist(Freelist&& other) noexcept :
+      Alloc(static_cast<const Alloc&>(other)), _chunks(other._chunks),
+      _chunk_count(other._chunk_count), _chunk_cap(other._chunk_cap),
+      _empty_head(other._empty_head), _bump(other._bump), _count(other._count) {
+    other._chunks = nullptr;
+    other._chunk_count = 0;
+    other._chunk_cap = 0;
+    other._empty_head = ELEM_TOMB;
+    other._bump = 0;
+    other._count = 0;
+  }
+
+  ~Freelist() noexcept {
+    static_assert(meta::nothrow_destructible<T>);
+    if constexpr (!meta::trivially_destructible<T>) {
+      for_each([](T& elem) { elem.~T(); });
+    }
+    chunk_alloc chunks{static_cast<const Alloc&>(*this)};
+    for (size_t i = 0; i < _chunk_count; ++i) {
+      chunks.deallocate(_chunks[i], 1);
+    }
+    if (_chunks) {
+      table_alloc table{static_cast<const Alloc&>(*this)};
+      table.deallocate(_chunks, _chunk_cap);
+    }
+  }
+
+  NTF_NO_COPY(Freelist);
+
+public:
+  element_slot insert(const value_type& elem) { return _do_insert(elem); }
+
+  element_slot insert(value_type&& elem) { return _do_insert(::ntf::move(elem)); }
+
+  template<typename... Args>
+  element_slot emplace(Args&&... args) {
+    return _do_insert(::ntf::forward<Args>(args)...);
+  }
+
+  void remove(element_slot slot) {
+    if (!has_element(slot)) {
+      return;
+    }
+    _do_remove(slot);
+  }
+
+  // Makes room for at least `count` elements without further allocations
+  void reserve(size_t count) {
+    while (_chunk_count * ChunkElems < count) {
+      _add_chunk();
+    }
+  }
+
+private:
+  template<typename... Args>
+  element_slot _do_insert(Args&&... args) {
+    element_slot pos;
+    if (_empty_head != ELEM_TOMB) {
+      pos = _empty_head;
+      _empty_head = _slot(pos).next;
+    } else {
+      if (_bump == _chunk_count * ChunkElems) {
+        _add_chunk();
+      }
+      pos = _bump++;
+    }
+    NTF_ASSERT(pos < ELEM_TOMB, "Freelist slot overflow");
+    NTF_ASSERT(!has_element(pos));
+
+    new (reinterpret_cast<T*>(_slot(pos).elem)) T(::ntf::forward<Args>(args)...);
+    _word(pos) |= u64(1) << (pos % 64);
+
+    ++_count;
+    return pos;
+  }
+
+  void _do_remove(element_slot pos) {
+    NTF_ASSERT(has_element(pos));
+    if constexpr (!meta::trivially_destructible<T>) {
+      _elem_at(pos).~T();
+    }
+    _word(pos) &= ~(u64(1) << (pos % 64));
+
+    _slot(pos).next = _empty_head;
+    _empty_head = pos;
+
+    --_count;
+  }
+
+  void _add_chunk() {
+    if (_chunk_count == _chunk_cap) {
+      const size_t new_cap = _chunk_cap ? _chunk_cap * 2 : 4;
+      table_alloc table{static_cast<const Alloc&>(*this)};
+      chunk_t** chunks = table.allocate(new_cap);
+      if (_chunks) {
+        memcpy(chunks, _chunks, _chunk_count * sizeof(chunk_t*));
+        table.deallocate(_chunks, _chunk_cap);
+      }
+      _chunks = chunks;
+      _chunk_cap = new_cap;
+    }
+    chunk_alloc chunks{static_cast<const Alloc&>(*this)};
+    chunk_t* chunk = chunks.allocate(1);
+    memset(chunk->occupied, 0x00, sizeof(chunk->occupied));
+    _chunks[_chunk_count++] = chunk;
+  }
+
+public:
+  template<typename F>
+  void for_each(F&& f) {
+    const size_t words = (_bump + 63) / 64;
+    for (size_t w = 0; w < words; ++w) {
+      u64 bits = _chunks[w / (ChunkElems / 64)]->occupied[w % (ChunkElems / 64)];
+      while (bits) {
+        const element_slot i = static_cast<element_slot>(w * 64 + __builtin_ctzll(bits));
+        bits &= bits - 1;
+        if constexpr (meta::invocable_with<meta::remove_cvref_t<F>, T&, element_slot>) {
+          f(_elem_at(i), i);
+        } else {
+          f(_elem_at(i));
+        }
+      }
+    }
+  }
+
+  template<typename F>
+  void for_each(F&& f) const {
+    const_cast<Freelist&>(*this).for_each([&f](const T& elem, element_slot slot) {
+      if constexpr (meta::invocable_with<meta::remove_cvref_t<F>, const T&, element_slot>) {
+        f(elem, slot);
+      } else {
+        f(elem);
+      }
+    });
+  }
+
+  // Keeps every chunk around for reuse
+  void clear() {
+    if constexpr (!meta::trivially_destructible<T>) {
+      for_each([](T& elem) { elem.~T(); });
+    }
+    const size_t used_chunks = (_bump + ChunkElems - 1) / ChunkElems;
+    for (size_t i = 0; i < used_chunks; ++i) {
+      memset(_chunks[i]->occupied, 0x00, sizeof(_chunks[i]->occupied));
+    }
+    _empty_head = ELEM_TOMB;
+    _bump = 0;
+    _count = 0;
+  }
+
+public:
+  size_t size() const noexcept { return _count; }
+
+  size_t capacity() const noexcept { return _chunk_count * ChunkElems; }
+
+  bool empty() const noexcept { return size() == 0; }
+
+  bool has_element(element_slot slot) const noexcept {
+    return slot < _bump && (_word(slot) >> (slot % 64)) & 1u;
+  }
+
+  const value_type& operator[](element_slot slot) const {
+    NTF_ASSERT(has_element(slot));
+    return _elem_at(slot);
+  }
+
+  value_type& operator[](element_slot slot) {
+    return const_cast<value_type&>(::ntf::as_const(*this)[slot]);
+  }
+
+  const value_type& at(element_slot slot) const {
+    NTF_THROW_IF(!has_element(slot), MsgException("Slot has no element"));
+    return _elem_at(slot);
+  }
+
+  value_type& at(element_slot slot) {
+    return const_cast<value_type&>(::ntf::as_const(*this).at(slot));
+  }
+
+  const value_type* at_opt(element_slot slot) const noexcept {
+    return has_element(slot) ? &_elem_at(slot) : nullptr;
+  }
+
+  value_type* at_opt(element_slot slot) noexcept {
+    return const_cast<value_type*>(::ntf::as_const(*this).at_opt(slot));
+  }
+
+private:
+  slot_t& _slot(element_slot slot) const {
+    return _chunks[slot / ChunkElems]->slots[slot % ChunkElems];
+  }
+
+  u64& _word(element_slot slot) const {
+    return _chunks[slot / ChunkElems]->occupied[(slot % ChunkElems) / 64];
+  }
+
+  const T& _elem_at(element_slot slot) const {
+    return *::ntf::launder(reinterpret_cast<const T*>(&_slot(slot).elem));
+  }
+
+  T& _elem_at(element_slot slot) { return const_cast<T&>(::ntf::as_const(*this)._elem_at(slot)); }
+
+private:
+  chunk_t** _chunks{nullptr};
+  size_t _chunk_count{0};
+  size_t _chunk_cap{0};
+  element_slot _empty_head{ELEM_TOMB};
+  u32 _bump{0}; // Slots at or past this index were never used
+  u32 _count{0};
+};
+
+struct SlotHandle {
+  FreelistSlot index;
+  u32 generation;
+
+  constexpr bool operator==(const SlotHandle&) const noexcept = default;
+};
+
+// Growable slot map. Handles carry a generation, so stale handles are detected after their slot
+// gets reused. Values are kept packed in a dense array, swap removed on removal
+template<typename T, typename Alloc = DefaultAlloc<T>>
+class SlotMap : private Alloc {
+public:
+  using value_type = T;
+  using handle_type = SlotHandle;
+  using size_type = size_t;
+  using allocator_type = Alloc;
+
+  using iterator = T*;
+  using const_iterator = const T*;
+
+  static_assert(meta::nothrow_move_constructible<T>, "T has to be nothrow move constructible");
+  static_assert(meta::nothrow_destructible<T>, "T has to be nothrow destructible");
+
+private:
+  struct slot_t {
+    u32 index; // Dense index when active, next free slot otherwise
+    u32 generation;
+  };
+
+  using slot_alloc = typename Alloc::template rebind<slot_t>;
+  using index_alloc = typename Alloc::template rebind<u32>;
+
+  static constexpr u32 SLOT_NIL = static_cast<u32>(-1);
+  static constexpr size_type MIN_CAPACITY = 8;
+
+public:
+  SlotMap() noexcept(meta::nothrow_default_constructible<Alloc>) : Alloc() {}
+
+  explicit SlotMap(const Alloc& alloc) noexcept(meta::nothrow_copy_constructible<Alloc>) :
+      Alloc(alloc) {}
+
+  SlotMap(SlotMap&& other) noexcept :
+      Alloc(static_cast<const Alloc&>(other)), _slots(other._slots), _values(other._values),
+      _dense_slots(other._dense_slots), _slot_count(other._slot_count),
+      _slot_cap(other._slot_cap), _size(other._size), _cap(other._cap),
+      _free_head(other._free_head) {
+    other._slots = nullptr;
+    other._values = nullptr;
+    other._dense_slots = nullptr;
+    other._slot_count = 0;
+    other._slot_cap = 0;
+    other._size = 0;
+    other._cap = 0;
+    other._free_head = SLOT_NIL;
+  }
+
+  ~SlotMap() noexcept { _free_all(); }
+
+  NTF_NO_COPY(SlotMap);
+
+public:
+  handle_type insert(const value_type& elem) { return emplace(elem); }
+
+  handle_type insert(value_type&& elem) { return emplace(::ntf::move(elem)); }
+
+  template<typename... Args>
+  handle_type emplace(Args&&... args) {
+    if (_size == _cap) {
+      _grow_values();
+    }
+    if (_free_head == SLOT_NIL && _slot_count == _slot_cap) {
+      _grow_slots();
+    }
+    construct_offset(_values, _size, ::ntf::forward<Args>(args)...);
+
+    u32 idx;
+    if (_free_head != SLOT_NIL) {
+      idx = _free_head;
+      _free_head = _slots[idx].index;
+    } else {
+      idx = static_cast<u32>(_slot_count++);
+      _slots[idx].generation = 1;
+    }
+    _slots[idx].index = static_cast<u32>(_size);
+    _dense_slots[_size] = idx;
+    ++_size;
+    return {idx, _slots[idx].generation};
+  }
+
+  bool remove(handle_type handle) noexcept {
+    if (!contains(handle)) {
+      return false;
+    }
+    slot_t& slot = _slots[handle.index];
+    const u32 dense = slot.index;
+    const u32 last = static_cast<u32>(_size - 1);
+    destroy_offset(_values, dense);
+    if (dense != last) {
+      construct_offset(_values, dense, ::ntf::move(_values[last]));
+      destroy_offset(_values, last);
+      _dense_slots[dense] = _dense_slots[last];
+      _slots[_dense_slots[dense]].index = dense;
+    }
+    --_size;
+
+    ++slot.generation;
+    slot.index = _free_head;
+    _free_head = handle.index;
+    return true;
+  }
+
+  void clear() noexcept {
+    for (size_type i = 0; i < _size; ++i) {
+      ++_slots[_dense_slots[i]].generation;
+    }
+    _destroy_values();
+    // Rebuild the free list with every slot
+    _free_head = SLOT_NIL;
+    for (size_type i = _slot_count; i > 0; --i) {
+      _slots[i - 1].index = _free_head;
+      _free_head = static_cast<u32>(i - 1);
+    }
+    _size = 0;
+  }
+
+public:
+  bool contains(handle_type handle) const noexcept {
+    return handle.index < _slot_count && _slots[handle.index].generation == handle.generation;
+  }
+
+  const value_type* at_opt(handle_type handle) const noexcept {
+    return contains(handle) ? &_values[_slots[handle.index].index] : nullptr;
+  }
+
+  value_type* at_opt(handle_type handle) noexcept {
+    return const_cast<value_type*>(::ntf::as_const(*this).at_opt(handle));
+  }
+
+  const value_type& at(handle_type handle) const {
+    NTF_THROW_IF(!contains(handle), MsgException("Invalid SlotMap handle"));
+    return _values[_slots[handle.index].index];
+  }
+
+  value_type& at(handle_type handle) {
+    return const_cast<value_type&>(::ntf::as_const(*this).at(handle));
+  }
+
+  const value_type& operator[](handle_type handle) const {
+    NTF_ASSERT(contains(handle), "Invalid SlotMap handle");
+    return _values[_slots[handle.index].index];
+  }
+
+  value_type& operator[](handle_type handle) {
+    return const_cast<value_type&>(::ntf::as_const(*this)[handle]);
+  }
+
+  // Handle of the value at a dense position
+  handle_type handle_at(size_type dense_idx) const noexcept {
+    NTF_ASSERT(dense_idx < _size);
+    const u32 idx = _dense_slots[dense_idx];
+    return {idx, _slots[idx].generation};
+  }
+
+public:
+  template<typename F>
+  void for_each(F&& f) {
+    for (size_type i = 0; i < _size; ++i) {
+      if constexpr (meta::invocable_with<meta::remove_cvref_t<F>, T&, handle_type>) {
+        f(_values[i], handle_at(i));
+      } else {
+        f(_values[i]);
+      }
+    }
+  }
+
+public:
+  size_type size() const noexcept { return _size; }
+
+  size_type capacity() const noexcept { return _cap; }
+
+  bool empty() const noexcept { return _size == 0; }
+
+  T* data() noexcept { return _values; }
+
+  const T* data() const noexcept { return _values; }
+
+  iterator begin() noexcept { return _values; }
+
+  const_iterator begin() const noexcept { return _values; }
+
+  iterator end() noexcept { return _values + _size; }
+
+  const_iterator end() const noexcept { return _values + _size; }
+
+private:
+  void _grow_values() {
+    const size_type new_cap = max(MIN_CAPACITY, _cap * 2);
+    index_alloc idx_alloc{static_cast<const Alloc&>(*this)};
+    T* values = Alloc::allocate(new_cap);
+    u32* dense_slots;
+#ifdef __cpp_exceptions
+    try {
+#endif
+      dense_slots = idx_alloc.allocate(new_cap);
+#ifdef __cpp_exceptions
+    } catch (...) {
+      Alloc::deallocate(values, new_cap);
+      throw;
+    }
+#endif
+    for (size_type i = 0; i < _size; ++i) {
+      construct_offset(values, i, ::ntf::move(_values[i]));
+      destroy_offset(_values, i);
+      dense_slots[i] = _dense_slots[i];
+    }
+    if (_values) {
+      Alloc::deallocate(_values, _cap);
+      idx_alloc.deallocate(_dense_slots, _cap);
+    }
+    _values = values;
+    _dense_slots = dense_slots;
+    _cap = new_cap;
+  }
+
+  void _grow_slots() {
+    const size_type new_cap = max(MIN_CAPACITY, _slot_cap * 2);
+    slot_alloc alloc{static_cast<const Alloc&>(*this)};
+    slot_t* slots = alloc.allocate(new_cap);
+    if (_slots) {
+      memcpy(slots, _slots, _slot_count * sizeof(slot_t));
+      alloc.deallocate(_slots, _slot_cap);
+    }
+    _slots = slots;
+    _slot_cap = new_cap;
+  }
+
+  void _destroy_values() noexcept {
+    if constexpr (!meta::trivially_destructible<T>) {
+      for (size_type i = 0; i < _size; ++i) {
+        destroy_offset(_values, i);
+      }
+    }
+  }
+
+  void _free_all() noexcept {
+    _destroy_values();
+    if (_values) {
+      index_alloc idx_alloc{static_cast<const Alloc&>(*this)};
+      Alloc::deallocate(_values, _cap);
+      idx_alloc.deallocate(_dense_slots, _cap);
+    }
+    if (_slots) {
+      slot_alloc alloc{static_cast<const Alloc&>(*this)};
+      alloc.deallocate(_slots, _slot_cap);
+    }
+  }
+
+private:
+  slot_t* _slots{nullptr};
+  T* _values{nullptr};
+  u32* _dense_slots{nullptr};
+  size_type _slot_count{0};
+  size_type _slot_cap{0};
+  size_type _size{0};
+  size_type _cap{0};
+  u32 _free_head{SLOT_NIL};
+};
+
+namespace impl {
+
+inline u32 this_thread_index() noexcept {
+  static u32 thread_count = 0;
+  thread_local u32 index = __atomic_fetch_add(&thread_count, 1, __ATOMIC_RELAXED);
+  return index;
+}
+
+} // namespace impl
+
+// Thread safe version of FixedFreelist. Free slots live in a lock-free list with a tagged head,
+// and each thread caches a magazine of free slots to avoid touching the shared head.
+// Iteration and clearing still require exclusive access
+template<typename T, size_t MaxElems, size_t MagazineSize = 32, size_t MagazineCount = 16>
+class ConcurrentFixedFreelist {
+public:
+  static constexpr size_t max_element_count = MaxElems;
+  using value_type = T;
+  using element_slot = FreelistSlot;
+
+  static constexpr element_slot null_slot = static_cast<element_slot>(-1);
+
+private:
+  struct slot_t {
+    alignas(T) u8 elem[sizeof(T)];
+    u32 next;
+  };
+
+  struct alignas(64) magazine_t {
+    u32 lock;
+    u32 count;
+    i64 live; // Inserts minus removes done by the threads using this magazine
+    element_slot slots[MagazineSize];
+  };
+
+  static constexpr element_slot ELEM_NIL = null_slot;
+  static constexpr element_slot ELEM_ACTIVE = ELEM_NIL - 1;
+  static_assert(MaxElems < ELEM_ACTIVE, "Invalid max element count");
+  static_assert(MagazineSize >= 2, "Magazines need at least two slots");
+  static_assert(MagazineCount > 0, "Invalid magazine count");
+
+  static constexpr u64 _pack_head(element_slot slot, u64 tag) noexcept {
+    return (tag << 32) | static_cast<u64>(slot);
+  }
+
+public:
+  ConcurrentFixedFreelist() noexcept :
+      _head(_pack_head(ELEM_NIL, 0)), _bump(0), _mags() {
+    for (auto& slot : _slots) {
+      slot.next = ELEM_NIL;
+    }
+  }
+
+  ~ConcurrentFixedFreelist() noexcept {
+    if constexpr (!meta::trivially_destructible<T>) {
+      static_assert(meta::nothrow_destructible<T>);
+      for_each([](T& elem) { elem.~T(); });
+    }
+  }
+
+  NTF_NO_COPY(ConcurrentFixedFreelist);
+  NTF_NO_MOVE(ConcurrentFixedFreelist);
+
+public:
+  element_slot insert(const value_type& elem) { return _do_insert(elem); }
+
+  element_slot insert(value_type&& elem) { return _do_insert(::ntf::move(elem)); }
+
+  template<typename... Args>
+  element_slot emplace(Args&&... args) {
+    return _do_insert(::ntf::forward<Args>(args)...);
+  }
+
+  // Returns null_slot instead of asserting when there are no free slots left
+  template<typename... Args>
+  element_slot try_emplace(Args&&... args) {
+    const element_slot pos = _acquire();
+    if (pos != ELEM_NIL) {
+      _construct(pos, ::ntf::forward<Args>(args)...);
+    }
+    return pos;
+  }
+
+  void remove(element_slot slot) {
+    if (slot >= MaxElems) {
+      return;
+    }
+    // Claim the slot first, so concurrent removes of the same slot destroy it only once
+    u32 expected = ELEM_ACTIVE;
+    if (!__atomic_compare_exchange_n(&_slots[slot].next, &expected, ELEM_NIL, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      return;
+    }
+    if constexpr (!meta::trivially_destructible<T>) {
+      _elem_at(slot).~T();
+    }
+    __atomic_fetch_sub(&_magazine().live, 1, __ATOMIC_RELAXED);
+    _release(slot);
+  }
+
+private:
+  template<typename... Args>
+  element_slot _do_insert(Args&&... args) {
+    const element_slot pos = _acquire();
+    NTF_ASSERT(pos != ELEM_NIL, "ConcurrentFixedFreelist is full");
+    _construct(pos, ::ntf::forward<Args>(args)...);
+    return pos;
+  }
+
+  template<typename... Args>
+  void _construct(element_slot pos, Args&&... args) {
+    auto& slot = _slots[pos];
+    new (reinterpret_cast<T*>(slot.elem)) T(::ntf::forward<Args>(args)...);
+    __atomic_store_n(&slot.next, ELEM_ACTIVE, __ATOMIC_RELEASE);
+
+    __atomic_fetch_add(&_magazine().live, 1, __ATOMIC_RELAXED);
+  }
+
+  magazine_t& _magazine() noexcept { return _mags[impl::this_thread_index() % MagazineCount]; }
+
+  static bool _try_lock(magazine_t& mag) noexcept {
+    return !__atomic_exchange_n(&mag.lock, 1, __ATOMIC_ACQUIRE);
+  }
+
+  static void _unlock(magazine_t& mag) noexcept {
+    __atomic_store_n(&mag.lock, 0, __ATOMIC_RELEASE);
+  }
+
+  element_slot _acquire() noexcept {
+    magazine_t& mag = _magazine();
+    if (_try_lock(mag)) {
+      if (mag.count) {
+        const element_slot slot = mag.slots[--mag.count];
+        _unlock(mag);
+        return slot;
+      }
+      _unlock(mag);
+    }
+
+    element_slot slot = _pop_global();
+    if (slot != ELEM_NIL) {
+      return slot;
+    }
+
+    // Slots that were never used don't need to go through the list
+    u32 bump = __atomic_load_n(&_bump, __ATOMIC_RELAXED);
+    while (bump < MaxElems) {
+      if (__atomic_compare_exchange_n(&_bump, &bump, bump + 1, true, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        return bump;
+      }
+    }
+
+    // Last resort, take slots cached by other threads
+    for (auto& other : _mags) {
+      if (!_try_lock(other)) {
+        continue;
+      }
+      if (other.count) {
+        slot = other.slots[--other.count];
+        _unlock(other);
+        return slot;
+      }
+      _unlock(other);
+    }
+    return ELEM_NIL;
+  }
+
+  void _release(element_slot slot) noexcept {
+    magazine_t& mag = _magazine();
+    if (!_try_lock(mag)) {
+      _push_global(slot, slot);
+      return;
+    }
+    if (mag.count == MagazineSize) {
+      // Give half of the magazine back as a single chain
+      constexpr u32 half = MagazineSize / 2;
+      const element_slot* chain = mag.slots + (MagazineSize - half);
+      for (u32 i = 0; i + 1 < half; ++i) {
+        __atomic_store_n(&_slots[chain[i]].next, chain[i + 1], __ATOMIC_RELAXED);
+      }
+      _push_global(chain[0], chain[half - 1]);
+      mag.count -= half;
+    }
+    mag.slots[mag.count++] = slot;
+    _unlock(mag);
+  }
+
+  void _push_global(element_slot first, element_slot last) noexcept {
+    u64 head = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+    u64 new_head;
+    do {
+      __atomic_store_n(&_slots[last].next, static_cast<element_slot>(head), __ATOMIC_RELAXED);
+      new_head = _pack_head(first, (head >> 32) + 1);
+    } while (!__atomic_compare_exchange_n(&_head, &head, new_head, true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+  }
+
+  element_slot _pop_global() noexcept {
+    u64 head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+    while (static_cast<element_slot>(head) != ELEM_NIL) {
+      const element_slot slot = static_cast<element_slot>(head);
+      // Might read a stale link if the slot got popped meanwhile, the tag makes the CAS fail then
+      const element_slot next = __atomic_load_n(&_slots[slot].next, __ATOMIC_RELAXED);
+      if (__atomic_compare_exchange_n(&_head, &head, _pack_head(next, (head >> 32) + 1), true,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        return slot;
+      }
+    }
+    return ELEM_NIL;
+  }
+
+public:
+  template<typename F>
+  void for_each(F&& f) {
+    const u32 bump = __atomic_load_n(&_bump, __ATOMIC_ACQUIRE);
+    for (element_slot i = 0; i < bump; ++i) {
+      if (!has_element(i)) {
+        continue;
+      }
+      if constexpr (meta::invocable_with<meta::remove_cvref_t<F>, T&, element_slot>) {
+        f(_elem_at(i), i);
+      } else {
+        f(_elem_at(i));
+      }
+    }
+  }
+
+public:
+  // Only exact when no other thread is inserting or removing
+  size_t size() const noexcept {
+    i64 count = 0;
+    for (const auto& mag : _mags) {
+      count += __atomic_load_n(&mag.live, __ATOMIC_RELAXED);
+    }
+    return static_cast<size_t>(count);
+  }
+
+  size_t capacity() const noexcept { return max_element_count; }
+
+  bool empty() const noexcept { return size() == 0; }
+
+  bool has_element(element_slot slot) const noexcept {
+    return slot < MaxElems && __atomic_load_n(&_slots[slot].next, __ATOMIC_ACQUIRE) == ELEM_ACTIVE;
+  }
+
+  const value_type& operator[](element_slot slot) const {
+    NTF_ASSERT(has_element(slot));
+    return _elem_at(slot);
+  }
+
+  value_type& operator[](element_slot slot) {
+    return const_cast<value_type&>(::ntf::as_const(*this)[slot]);
+  }
+
+  const value_type& at(element_slot slot) const {
+    NTF_THROW_IF(!has_element(slot), MsgException("Slot has no element"));
+    return _elem_at(slot);
+  }
+
+  value_type& at(element_slot slot) {
+    return const_cast<value_type&>(::ntf::as_const(*this).at(slot));
+  }
+
+  const value_type* at_opt(element_slot slot) const noexcept {
+    return has_element(slot) ? &_elem_at(slot) : nullptr;
+  }
+
+  value_type* at_opt(element_slot slot) noexcept {
+    return const_cast<value_type*>(::ntf::as_const(*this).at_opt(slot));
+  }
+
+private:
+  const T& _elem_at(element_slot slot) const {
+    return *::ntf::launder(reinterpret_cast<const T*>(&_slots[slot].elem));
+  }
+
+  T& _elem_at(element_slot slot) { return const_cast<T&>(::ntf::as_const(*this)._elem_at(slot)); }
+
+private:
+  slot_t _slots[MaxElems];
+  alignas(64) u64 _head;
+  u32 _bump;
+  magazine_t _mags[MagazineCount];
+};
+
 } // namespace ntf
 
 #endif // NTF_FREELIST_HPP_
@@ -220,6 +220,141 @@ private:
   bool _is_object;
 };
 
+// Move only type erased function for callables that fit in an inline buffer. Unlike TrivFn, it
+// takes callables with non trivial moves and destructors, so it never allocates
+template<typename Signature, size_t MaxSize, size_t MaxAlign = alignof(void*)>
+class InplaceFn;
+
+template<size_t MaxSize, size_t MaxAlign, bool IsNoexcept, typename Ret, typename... Args>
+class InplaceFn<Ret(Args...) noexcept(IsNoexcept), MaxSize, MaxAlign> {
+private:
+  template<typename T>
+  static constexpr bool is_valid_func =
+    meta::invocable_with_r<T, Ret, Args...> && !meta::is_same_v<InplaceFn, T> &&
+    meta::nothrow_move_constructible<T> && meta::nothrow_destructible<T> &&
+    sizeof(T) <= MaxSize && alignof(T) <= MaxAlign;
+
+  // Moves the object at src into dst and destroys it. Only destroys it if dst is null
+  template<typename T>
+  static void _manage_obj(void* dst, void* src) noexcept {
+    T* obj = ::ntf::launder(static_cast<T*>(src));
+    if (dst) {
+      NTF_PNEW(dst) T(::ntf::move(*obj));
+    }
+    obj->~T();
+  }
+
+public:
+  template<typename T>
+  static constexpr bool can_hold = is_valid_func<meta::remove_cvref_t<T>>;
+
+public:
+  InplaceFn() noexcept : _invoke(nullptr), _manage(nullptr) {}
+
+  InplaceFn(Ret (*func_ptr)(Args...) noexcept(IsNoexcept)) {
+    NTF_THROW_IF(!func_ptr, MsgException("Assigning null function pointer to InplaceFn"));
+    _construct<decltype(func_ptr)>(func_ptr);
+  }
+
+  template<typename Fn>
+  requires(is_valid_func<meta::remove_cvref_t<Fn>>)
+  InplaceFn(Fn&& callable) noexcept(meta::nothrow_constructible<meta::remove_cvref_t<Fn>, Fn>) {
+    _construct<meta::remove_cvref_t<Fn>>(::ntf::forward<Fn>(callable));
+  }
+
+  template<typename Fn, typename... Args2>
+  requires(is_valid_func<Fn> && meta::constructible_from<Fn, Args2...>)
+  explicit InplaceFn(in_place_type_t<Fn>, Args2&&... args) {
+    _construct<Fn>(::ntf::forward<Args2>(args)...);
+  }
+
+public:
+  InplaceFn(InplaceFn&& other) noexcept : _invoke(other._invoke), _manage(other._manage) {
+    if (_manage) {
+      _manage(_buffer, other._buffer);
+      other._invoke = nullptr;
+      other._manage = nullptr;
+    }
+  }
+
+  ~InplaceFn() noexcept { reset(); }
+
+  NTF_NO_COPY(InplaceFn);
+
+public:
+  Ret operator()(Args... args) noexcept(IsNoexcept) {
+    NTF_ASSERT(_invoke, "Calling empty InplaceFn");
+    if constexpr (meta::is_void_v<Ret>) {
+      _invoke(_buffer, ::ntf::forward<Args>(args)...);
+    } else {
+      return _invoke(_buffer, ::ntf::forward<Args>(args)...);
+    }
+  }
+
+  explicit operator bool() const noexcept { return _invoke != nullptr; }
+
+public:
+  template<typename Fn>
+  requires(is_valid_func<meta::remove_cvref_t<Fn>>)
+  InplaceFn& emplace(Fn&& callable) noexcept(
+    meta::nothrow_constructible<meta::remove_cvref_t<Fn>, Fn>) {
+    reset();
+    _construct<meta::remove_cvref_t<Fn>>(::ntf::forward<Fn>(callable));
+    return *this;
+  }
+
+  template<typename Fn, typename... Args2>
+  requires(is_valid_func<Fn> && meta::constructible_from<Fn, Args2...>)
+  InplaceFn& emplace(in_place_type_t<Fn>, Args2&&... args) {
+    reset();
+    _construct<Fn>(::ntf::forward<Args2>(args)...);
+    return *this;
+  }
+
+  void reset() noexcept {
+    if (_manage) {
+      _manage(nullptr, _buffer);
+      _invoke = nullptr;
+      _manage = nullptr;
+    }
+  }
+
+public:
+  InplaceFn& operator=(InplaceFn&& other) noexcept {
+    if (this != &other) {
+      reset();
+      if (other._manage) {
+        other._manage(_buffer, other._buffer);
+        _invoke = other._invoke;
+        _manage = other._manage;
+        other._invoke = nullptr;
+        other._manage = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  template<typename F>
+  requires(is_valid_func<meta::remove_cvref_t<F>>)
+  InplaceFn& operator=(F&& callable) noexcept(
+    meta::nothrow_constructible<meta::remove_cvref_t<F>, F>) {
+    return emplace(::ntf::forward<F>(callable));
+  }
+
+private:
+  template<typename T, typename... CArgs>
+  void _construct(CArgs&&... args) {
+    NTF_PNEW(_buffer) T(::ntf::forward<CArgs>(args)...);
+    _invoke = &impl::ErasedInvoker<T, false, IsNoexcept, Ret, Args...>::invoke;
+    _manage = &_manage_obj<T>;
+  }
+
+private:
+  alignas(MaxAlign) u8 _buffer[MaxSize];
+  Ret (*_invoke)(void*, Args...) noexcept(IsNoexcept);
+  void (*_manage)(void*, void*) noexcept;
+};
+
 } // namespace ntf
 
 #endif // NTF_FUNC_HPP_
@@ -6,12 +6,90 @@
 extern "C" {
 
 NTF_DEFINE_HANDLE(ntf_Arena);
+NTF_DEFINE_HANDLE(ntf_SharedArena);
+NTF_DEFINE_HANDLE(ntf_SlabPool);
+
+typedef enum ntf_ArenaFlags {
+  NTF_ARENA_FIXED = 0,
+  // Map a new, geometrically larger block when the current one is full
+  NTF_ARENA_CHAINED = 1 << 0,
+  // Reserve the whole capacity and commit pages on demand, set by ntf_arena_init_reserve
+  NTF_ARENA_RESERVE = 1 << 1,
+  // Align blocks to 2MiB and madvise(MADV_HUGEPAGE) them
+  NTF_ARENA_HUGEPAGE = 1 << 2,
+  // Try to map blocks with MAP_HUGETLB, falling back to other modes if no pages are available.
+  // Ignored by reserved arenas
+  NTF_ARENA_HUGETLB = 1 << 3,
+} ntf_ArenaFlags;
+
+typedef enum ntf_ArenaPageMode {
+  NTF_ARENA_PAGES_NORMAL = 0,
+  NTF_ARENA_PAGES_TRANSPARENT,
+  NTF_ARENA_PAGES_HUGETLB,
+} ntf_ArenaPageMode;
+
+// What to do with memory above the retained watermark on clear
+typedef enum ntf_ArenaClearPolicy {
+  NTF_ARENA_CLEAR_KEEP = 0, // Keep every page resident for reuse
+  NTF_ARENA_CLEAR_TRIM,     // Unmap chained blocks, the first block is never unmapped
+  NTF_ARENA_CLEAR_FREE,     // Release pages lazily with MADV_FREE
+  NTF_ARENA_CLEAR_DONTNEED, // Release pages eagerly with MADV_DONTNEED
+} ntf_ArenaClearPolicy;
+
+typedef struct ntf_ArenaMark {
+  void* block;
+  size_t used;
+  size_t total;
+} ntf_ArenaMark;
+
+// Only tracked when built with NTF_ARENA_STATS, except for `used` and `retained`
+typedef struct ntf_ArenaStats {
+  size_t used;        // Bytes currently handed out, padding included
+  size_t retained;    // Watermark kept resident by the last clear
+  size_t peak;        // High water mark of `used`
+  size_t allocations; // Successful allocations
+  size_t padding;     // Bytes lost to alignment padding
+  size_t clears;
+  size_t failed; // Allocations that returned null
+} ntf_ArenaStats;
 
 size_t ntf_system_page_size() noexcept;
 int ntf_arena_init(ntf_Arena* arena, size_t capacity) noexcept;
+int ntf_arena_init_ex(ntf_Arena* arena, size_t capacity, uint32_t flags) noexcept;
+int ntf_arena_init_reserve(ntf_Arena* arena, size_t reserve, size_t commit_step,
+                           uint32_t flags) noexcept;
 void ntf_arena_destroy(ntf_Arena arena) noexcept;
 void ntf_arena_clear(ntf_Arena arena) noexcept;
+void ntf_arena_set_clear_policy(ntf_Arena arena, ntf_ArenaClearPolicy policy) noexcept;
+void ntf_arena_set_retain(ntf_Arena arena, size_t min_retain, uint32_t decay_shift) noexcept;
 void* ntf_arena_alloc(ntf_Arena arena, size_t size, size_t align) noexcept;
+void* ntf_arena_realloc(ntf_Arena arena, void* ptr, size_t old_size, size_t new_size,
+                        size_t align) noexcept;
+int ntf_arena_resize(ntf_Arena arena, void* ptr, size_t old_size, size_t new_size) noexcept;
+void ntf_arena_free(ntf_Arena arena, void* ptr, size_t size) noexcept;
+ntf_ArenaMark ntf_arena_mark(ntf_Arena arena) noexcept;
+void ntf_arena_rewind(ntf_Arena arena, ntf_ArenaMark mark) noexcept;
+ntf_Arena ntf_arena_scratch(const ntf_Arena* conflicts, size_t conflict_count) noexcept;
+
+// Thread safe arena, allocations only need an atomic fetch-add. With a non zero chunk_size each
+// thread bumps inside its own cached chunk and only touches the shared counter to grab a new one.
+// Clearing and destroying must not race with allocations
+int ntf_shared_arena_init(ntf_SharedArena* arena, size_t capacity, size_t chunk_size) noexcept;
+void ntf_shared_arena_destroy(ntf_SharedArena arena) noexcept;
+void ntf_shared_arena_clear(ntf_SharedArena arena) noexcept;
+void* ntf_shared_arena_alloc(ntf_SharedArena arena, size_t size, size_t align) noexcept;
+size_t ntf_shared_arena_used(ntf_SharedArena arena) noexcept;
+
+// Segregated size class allocator, not thread safe. Blocks up to 32KiB come from per class free
+// lists carved from chained arena blocks, bigger ones are mapped directly.
+// Frees have to pass the same size and alignment used to allocate
+int ntf_slab_init(ntf_SlabPool* pool) noexcept;
+void ntf_slab_destroy(ntf_SlabPool pool) noexcept;
+void* ntf_slab_alloc(ntf_SlabPool pool, size_t size, size_t align) noexcept;
+void ntf_slab_free(ntf_SlabPool pool, void* ptr, size_t size, size_t align) noexcept;
+size_t ntf_arena_capacity(ntf_Arena arena) noexcept;
+ntf_ArenaPageMode ntf_arena_page_mode(ntf_Arena arena) noexcept;
+int ntf_arena_stats(ntf_Arena arena, ntf_ArenaStats* stats) noexcept;
 
 } // extern "C"
 
@@ -161,6 +239,10 @@ struct ArenaDelete {
 template<typename T>
 class ArenaAlloc;
 
+struct arena_reserve_t {};
+
+constexpr inline arena_reserve_t arena_reserve;
+
 class Arena {
 public:
   template<typename T>
@@ -169,6 +251,15 @@ public:
 public:
   constexpr Arena(ntf_Arena arena) noexcept : _arena(arena) {}
 
+  explicit Arena(size_t capacity, u32 flags = NTF_ARENA_FIXED) : _arena(nullptr) {
+    NTF_THROW_IF(::ntf_arena_init_ex(&_arena, capacity, flags), BadAlloc());
+  }
+
+  Arena(arena_reserve_t, size_t reserve, size_t commit_step = 0,
+        u32 flags = NTF_ARENA_FIXED) : _arena(nullptr) {
+    NTF_THROW_IF(::ntf_arena_init_reserve(&_arena, reserve, commit_step, flags), BadAlloc());
+  }
+
   constexpr Arena(Arena&& other) noexcept : _arena(other._arena) { other._arena = nullptr; }
 
   ~Arena() noexcept { ::ntf_arena_destroy(_arena); }
@@ -191,12 +282,41 @@ public:
     return ptr;
   }
 
-  void deallocate(void* ptr, size_t size) const noexcept {
-    NTF_UNUSED(ptr);
-    NTF_UNUSED(size);
+  void* reallocate(void* ptr, size_t old_size, size_t new_size, size_t align) const {
+    void* new_ptr = ::ntf_arena_realloc(_arena, ptr, old_size, new_size, align);
+    NTF_THROW_IF(!new_ptr, BadAlloc());
+    return new_ptr;
+  }
+
+  void deallocate(void* ptr, size_t size) const noexcept { ::ntf_arena_free(_arena, ptr, size); }
+
+  void clear() const noexcept { ::ntf_arena_clear(_arena); }
+
+  ntf_ArenaMark mark() const noexcept { return ::ntf_arena_mark(_arena); }
+
+  void rewind(ntf_ArenaMark mark) const noexcept { ::ntf_arena_rewind(_arena, mark); }
+
+  void set_clear_policy(ntf_ArenaClearPolicy policy) const noexcept {
+    ::ntf_arena_set_clear_policy(_arena, policy);
+  }
+
+  // Memory below max(min_retain, decayed high water mark) survives clears. The high water mark
+  // loses 1/2^decay_shift of its value on every clear, a decay_shift of 0 disables it
+  void set_retain(size_t min_retain, u32 decay_shift = 0) const noexcept {
+    ::ntf_arena_set_retain(_arena, min_retain, decay_shift);
   }
 
 public:
+  size_t capacity() const noexcept { return ::ntf_arena_capacity(_arena); }
+
+  ntf_ArenaPageMode page_mode() const noexcept { return ::ntf_arena_page_mode(_arena); }
+
+  ntf_ArenaStats stats() const noexcept {
+    ntf_ArenaStats stats;
+    ::ntf_arena_stats(_arena, &stats);
+    return stats;
+  }
+
   constexpr ntf_Arena arena() const noexcept { return _arena; }
 
   constexpr operator ntf_Arena() const noexcept { return _arena; }
@@ -207,6 +327,305 @@ private:
 
 static_assert(meta::mem_resource<Arena>);
 
+// Rewinds the arena to the point where the scope was created
+class ArenaScope {
+public:
+  explicit ArenaScope(ntf_Arena arena) noexcept :
+      _arena(arena), _mark(::ntf_arena_mark(arena)) {}
+
+  explicit ArenaScope(const Arena& arena) noexcept : ArenaScope(arena.arena()) {}
+
+  ~ArenaScope() noexcept { ::ntf_arena_rewind(_arena, _mark); }
+
+  NTF_NO_COPY(ArenaScope);
+  NTF_NO_MOVE(ArenaScope);
+
+public:
+  constexpr ntf_Arena arena() const noexcept { return _arena; }
+
+  constexpr operator ntf_Arena() const noexcept { return _arena; }
+
+private:
+  ntf_Arena _arena;
+  ntf_ArenaMark _mark;
+};
+
+// Borrows one of the calling thread's scratch arenas, skipping the ones passed as conflicts.
+// Everything allocated from it is released when the ScratchArena is destroyed
+class ScratchArena : public ArenaScope {
+public:
+  template<typename T>
+  using bind_alloc = ArenaAlloc<T>;
+
+private:
+  static ntf_Arena _borrow(const ntf_Arena* conflicts, size_t count) {
+    ntf_Arena arena = ::ntf_arena_scratch(conflicts, count);
+    NTF_THROW_IF(!arena, BadAlloc());
+    return arena;
+  }
+
+  template<size_t N>
+  static ntf_Arena _borrow(const ntf_Arena (&conflicts)[N]) {
+    return _borrow(conflicts, N);
+  }
+
+public:
+  ScratchArena() : ArenaScope(_borrow(nullptr, 0)) {}
+
+  template<typename... Arenas>
+  requires(sizeof...(Arenas) > 0 && (meta::convertible_to<ntf_Arena, const Arenas&> && ...))
+  explicit ScratchArena(const Arenas&... conflicts) :
+      ArenaScope(_borrow({static_cast<ntf_Arena>(conflicts)...})) {}
+
+  // Not a copy, borrows a scratch arena other than the one `conflict` uses
+  explicit ScratchArena(const ScratchArena& conflict) : ScratchArena(conflict.arena()) {}
+
+  ScratchArena(ScratchArena&&) = delete;
+
+  ScratchArena(const ntf_Arena* conflicts, size_t count) :
+      ArenaScope(_borrow(conflicts, count)) {}
+
+public:
+  void* allocate(size_t size, size_t align) const {
+    void* ptr = ::ntf_arena_alloc(arena(), size, align);
+    NTF_THROW_IF(!ptr, BadAlloc());
+    return ptr;
+  }
+
+  void deallocate(void* ptr, size_t size) const noexcept { ::ntf_arena_free(arena(), ptr, size); }
+};
+
+static_assert(meta::mem_resource<ScratchArena>);
+
+template<typename T>
+class SharedArenaAlloc;
+
+class SharedArena {
+public:
+  template<typename T>
+  using bind_alloc = SharedArenaAlloc<T>;
+
+public:
+  constexpr SharedArena(ntf_SharedArena arena) noexcept : _arena(arena) {}
+
+  explicit SharedArena(size_t capacity, size_t chunk_size = 0) : _arena(nullptr) {
+    NTF_THROW_IF(::ntf_shared_arena_init(&_arena, capacity, chunk_size), BadAlloc());
+  }
+
+  constexpr SharedArena(SharedArena&& other) noexcept : _arena(other._arena) {
+    other._arena = nullptr;
+  }
+
+  ~SharedArena() noexcept { ::ntf_shared_arena_destroy(_arena); }
+
+  SharedArena& operator=(SharedArena&& other) noexcept {
+    ::ntf_shared_arena_destroy(_arena);
+
+    _arena = other._arena;
+    other._arena = nullptr;
+
+    return *this;
+  }
+
+  NTF_NO_COPY(SharedArena);
+
+public:
+  void* allocate(size_t size, size_t align) const {
+    void* ptr = ::ntf_shared_arena_alloc(_arena, size, align);
+    NTF_THROW_IF(!ptr, BadAlloc());
+    return ptr;
+  }
+
+  void deallocate(void* ptr, size_t size) const noexcept {
+    NTF_UNUSED(ptr);
+    NTF_UNUSED(size);
+  }
+
+  void clear() const noexcept { ::ntf_shared_arena_clear(_arena); }
+
+public:
+  size_t used() const noexcept { return ::ntf_shared_arena_used(_arena); }
+
+  constexpr ntf_SharedArena arena() const noexcept { return _arena; }
+
+  constexpr operator ntf_SharedArena() const noexcept { return _arena; }
+
+private:
+  ntf_SharedArena _arena;
+};
+
+static_assert(meta::mem_resource<SharedArena>);
+
+template<typename T>
+class SharedArenaAlloc {
+public:
+  using value_type = T;
+  using pointer = T*;
+  using size_type = size_t;
+  using difference_type = ptrdiff_t;
+
+public:
+  template<typename U>
+  using rebind = SharedArenaAlloc<U>;
+
+public:
+  constexpr SharedArenaAlloc(const SharedArena& arena) noexcept : _arena(arena.arena()) {}
+
+  constexpr SharedArenaAlloc(ntf_SharedArena arena) noexcept : _arena(arena) {}
+
+  constexpr SharedArenaAlloc(const SharedArenaAlloc&) noexcept = default;
+
+  template<typename U>
+  requires(!meta::is_same_v<U, T>)
+  constexpr SharedArenaAlloc(const rebind<U>& other) noexcept : _arena(other.arena()) {}
+
+public:
+  T* allocate(size_t n) {
+    T* ptr = static_cast<T*>(::ntf_shared_arena_alloc(_arena, n * sizeof(T), alignof(T)));
+    NTF_THROW_IF(!ptr, BadAlloc());
+    return ptr;
+  }
+
+  void deallocate(T* ptr, size_t n) noexcept {
+    NTF_UNUSED(ptr);
+    NTF_UNUSED(n);
+  }
+
+public:
+  constexpr ntf_SharedArena arena() const { return _arena; }
+
+public:
+  constexpr bool operator==(const SharedArenaAlloc& other) const noexcept {
+    return _arena == other._arena;
+  }
+
+  template<typename U>
+  requires(!meta::is_same_v<U, T>)
+  constexpr bool operator==(const rebind<U>& other) const noexcept {
+    return _arena == other.arena();
+  }
+
+private:
+  ntf_SharedArena _arena;
+};
+
+static_assert(meta::allocator_of<SharedArenaAlloc<int>, int>);
+
+template<typename T>
+class SlabAlloc;
+
+class SlabPool {
+public:
+  template<typename T>
+  using bind_alloc = SlabAlloc<T>;
+
+public:
+  constexpr SlabPool(ntf_SlabPool pool) noexcept : _pool(pool) {}
+
+  SlabPool() : _pool(nullptr) { NTF_THROW_IF(::ntf_slab_init(&_pool), BadAlloc()); }
+
+  constexpr SlabPool(SlabPool&& other) noexcept : _pool(other._pool) { other._pool = nullptr; }
+
+  ~SlabPool() noexcept { ::ntf_slab_destroy(_pool); }
+
+  SlabPool& operator=(SlabPool&& other) noexcept {
+    ::ntf_slab_destroy(_pool);
+
+    _pool = other._pool;
+    other._pool = nullptr;
+
+    return *this;
+  }
+
+  NTF_NO_COPY(SlabPool);
+
+public:
+  // deallocate can't tell which class an over aligned block came from, so those are rejected
+  // here. Use allocate_aligned with deallocate_aligned, or bind_alloc, for them instead
+  void* allocate(size_t size, size_t align) const {
+    NTF_THROW_IF(align > alignof(max_align_t), BadAlloc());
+    return allocate_aligned(size, align);
+  }
+
+  void deallocate(void* ptr, size_t size) const noexcept {
+    ::ntf_slab_free(_pool, ptr, size, alignof(max_align_t));
+  }
+
+  void* allocate_aligned(size_t size, size_t align) const {
+    void* ptr = ::ntf_slab_alloc(_pool, size, align);
+    NTF_THROW_IF(!ptr, BadAlloc());
+    return ptr;
+  }
+
+  void deallocate_aligned(void* ptr, size_t size, size_t align) const noexcept {
+    ::ntf_slab_free(_pool, ptr, size, align);
+  }
+
+public:
+  constexpr ntf_SlabPool pool() const noexcept { return _pool; }
+
+  constexpr operator ntf_SlabPool() const noexcept { return _pool; }
+
+private:
+  ntf_SlabPool _pool;
+};
+
+static_assert(meta::mem_resource<SlabPool>);
+
+template<typename T>
+class SlabAlloc {
+public:
+  using value_type = T;
+  using pointer = T*;
+  using size_type = size_t;
+  using difference_type = ptrdiff_t;
+
+public:
+  template<typename U>
+  using rebind = SlabAlloc<U>;
+
+public:
+  constexpr SlabAlloc(const SlabPool& pool) noexcept : _pool(pool.pool()) {}
+
+  constexpr SlabAlloc(ntf_SlabPool pool) noexcept : _pool(pool) {}
+
+  constexpr SlabAlloc(const SlabAlloc&) noexcept = default;
+
+  template<typename U>
+  requires(!meta::is_same_v<U, T>)
+  constexpr SlabAlloc(const rebind<U>& other) noexcept : _pool(other.pool()) {}
+
+public:
+  T* allocate(size_t n) {
+    T* ptr = static_cast<T*>(::ntf_slab_alloc(_pool, n * sizeof(T), alignof(T)));
+    NTF_THROW_IF(!ptr, BadAlloc());
+    return ptr;
+  }
+
+  void deallocate(T* ptr, size_t n) noexcept {
+    ::ntf_slab_free(_pool, ptr, n * sizeof(T), alignof(T));
+  }
+
+public:
+  constexpr ntf_SlabPool pool() const { return _pool; }
+
+public:
+  constexpr bool operator==(const SlabAlloc& other) const noexcept {
+    return _pool == other._pool;
+  }
+
+  template<typename U>
+  requires(!meta::is_same_v<U, T>)
+  constexpr bool operator==(const rebind<U>& other) const noexcept {
+    return _pool == other.pool();
+  }
+
+private:
+  ntf_SlabPool _pool;
+};
+
+static_assert(meta::allocator_of<SlabAlloc<int>, int>);
+
 template<typename T>
 class ArenaAlloc {
 public:
@@ -237,9 +656,11 @@ public:
     return ptr;
   }
 
-  void deallocate(T* ptr, size_t n) noexcept {
-    NTF_UNUSED(ptr);
-    NTF_UNUSED(n);
+  void deallocate(T* ptr, size_t n) noexcept { ::ntf_arena_free(_arena, ptr, n * sizeof(T)); }
+
+  // Grows or shrinks the allocation without moving it, only works for the last allocation
+  bool try_extend(T* ptr, size_t old_n, size_t new_n) noexcept {
+    return !::ntf_arena_resize(_arena, ptr, old_n * sizeof(T), new_n * sizeof(T));
   }
 
 public:
@@ -253,7 +674,7 @@ public:
   template<typename U>
   requires(!meta::is_same_v<U, T>)
   constexpr bool operator==(const rebind<U>& other) const noexcept {
-    return _arena == &other.arena();
+    return _arena == other.arena();
   }
 
 private:
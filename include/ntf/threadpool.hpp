@@ -1,82 +1,1174 @@
 #ifndef NTF_THREADPOOL_HPP_
 #define NTF_THREADPOOL_HPP_
 
-#include <ntf/core.hpp>
+#include <ntf/expected.hpp>
+#include <ntf/freelist.hpp>
+#include <ntf/func.hpp>
+#include <ntf/span.hpp>
 
 // TODO: Remove stdlib here
-#include <condition_variable>
-#include <functional>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <vector>
+
+// Both set the layout of ThreadPool, so they have to match the ones the library was built with.
+// Set them through the CMake cache variables of the same name, never before including this header
+
+// Inline storage for enqueued callables, bigger ones get boxed in the heap
+#ifndef NTF_THREADPOOL_TASK_SIZE
+#define NTF_THREADPOOL_TASK_SIZE 48
+#endif
+
+// Task slots shared by the worker deques in work stealing mode
+#ifndef NTF_THREADPOOL_LOCAL_TASKS
+#define NTF_THREADPOOL_LOCAL_TASKS 4096
+#endif
 
 namespace ntf {
 
-class ThreadPool {
+enum ThreadPoolFlags : u32 {
+  POOL_SHARED_QUEUE = 0,
+  // Every worker owns a deque. Tasks enqueued from a worker go to its own deque, the rest go to
+  // the shared injection queue. Workers with nothing to do steal from the others
+  POOL_WORK_STEALING = 1 << 0,
+  // Pin every worker to a CPU, one per physical core before using SMT siblings, packed by last
+  // level cache domain. With work stealing, thieves try victims sharing a cache first
+  POOL_PIN_WORKERS = 1 << 1,
+};
+
+struct CpuInfo {
+  u32 id;      // As used by sched_setaffinity
+  u32 core;    // First CPU of the physical core, shared by SMT siblings
+  u32 llc;     // First CPU of the last level cache domain
+  u32 package; // Socket
+};
+
+// CPUs the process is allowed to run on, as described by /sys/devices/system/cpu. When some
+// entry is missing, every CPU becomes its own core in a single cache domain
+std::vector<CpuInfo> cpu_topology();
+
+// 0 for SMT siblings, 1 when sharing the last level cache, 2 on the same package, 3 otherwise
+u32 cpu_distance(const CpuInfo& a, const CpuInfo& b) noexcept;
+
+// Workers drain the lanes from high to low, see ThreadPoolConfig::aging_ns
+enum class TaskPriority : u8 {
+  high = 0,
+  normal,
+  low,
+};
+
+// CLOCK_MONOTONIC in nanoseconds, the clock used by task deadlines
+u64 monotonic_ns() noexcept;
+
+enum class TaskError : u8 {
+  exception, // The task threw
+};
+
+class ThreadPool;
+
+// Tag for ThreadPool::enqueue overloads that return a Future
+struct with_future_t {};
+
+constexpr inline with_future_t with_future;
+
+namespace impl {
+
+// Thin wrappers around the futex syscall, private to the process
+void futex_wait(u32* addr, u32 expected) noexcept;
+void futex_wait(u32* addr, u32 expected, u64 timeout_ns) noexcept;
+void futex_wake(u32* addr, u32 count) noexcept;
+
+// Chase-Lev work stealing deque. The owner pushes and pops at the bottom (LIFO), thieves take
+// from the top (FIFO). Only holds trivially copyable values, usually pointers
+template<typename T>
+class WorkDeque {
+  static_assert(meta::trivially_copyable<T>);
+
+  struct ring_t {
+    i64 mask;
+    ring_t* prev; // Rings replaced by a grow, thieves might still be reading them
+    T* slots;
+  };
+
 public:
-  using task_type = std::function<void()>;
+  explicit WorkDeque(size_t capacity = 256) : _ring(_make_ring(capacity, nullptr)) {}
+
+  ~WorkDeque() noexcept {
+    ring_t* ring = _ring;
+    while (ring) {
+      ring_t* prev = ring->prev;
+      ::free(ring);
+      ring = prev;
+    }
+  }
+
+  NTF_NO_COPY(WorkDeque);
+  NTF_NO_MOVE(WorkDeque);
 
 public:
-  ThreadPool(std::size_t n_threads = std::thread::hardware_concurrency()) {
-    for (size_t i = 0; i < n_threads; ++i) {
-      _threads.emplace_back([this]() {
-        while (true) {
-          task_type task;
+  // Owner only
+  void push(T value) {
+    const i64 bottom = __atomic_load_n(&_bottom, __ATOMIC_RELAXED);
+    const i64 top = __atomic_load_n(&_top, __ATOMIC_ACQUIRE);
+    ring_t* ring = __atomic_load_n(&_ring, __ATOMIC_RELAXED);
+    if (bottom - top > ring->mask) {
+      ring = _grow(ring, top, bottom);
+    }
+    __atomic_store_n(&ring->slots[bottom & ring->mask], value, __ATOMIC_RELAXED);
+    __atomic_store_n(&_bottom, bottom + 1, __ATOMIC_RELEASE);
+  }
+
+  // Owner only
+  bool pop(T& out) noexcept {
+    const i64 bottom = __atomic_load_n(&_bottom, __ATOMIC_RELAXED) - 1;
+    ring_t* ring = __atomic_load_n(&_ring, __ATOMIC_RELAXED);
+    __atomic_store_n(&_bottom, bottom, __ATOMIC_SEQ_CST);
+    i64 top = __atomic_load_n(&_top, __ATOMIC_SEQ_CST);
+    if (top > bottom) {
+      __atomic_store_n(&_bottom, bottom + 1, __ATOMIC_RELAXED);
+      return false;
+    }
+    out = __atomic_load_n(&ring->slots[bottom & ring->mask], __ATOMIC_RELAXED);
+    if (top == bottom) {
+      // Last element, race against the thieves for it
+      const bool won = __atomic_compare_exchange_n(&_top, &top, top + 1, false, __ATOMIC_SEQ_CST,
+                                                   __ATOMIC_RELAXED);
+      __atomic_store_n(&_bottom, bottom + 1, __ATOMIC_RELAXED);
+      return won;
+    }
+    return true;
+  }
 
-          {
-            std::unique_lock<std::mutex> lock(_task_mtx);
-            _cv.wait(lock, [this]() { return !_tasks.empty() || _stop; });
+  // Any thread. Retries until it takes something or sees the deque empty
+  bool steal(T& out) noexcept {
+    while (true) {
+      i64 top = __atomic_load_n(&_top, __ATOMIC_SEQ_CST);
+      const i64 bottom = __atomic_load_n(&_bottom, __ATOMIC_SEQ_CST);
+      if (top >= bottom) {
+        return false;
+      }
+      ring_t* ring = __atomic_load_n(&_ring, __ATOMIC_ACQUIRE);
+      out = __atomic_load_n(&ring->slots[top & ring->mask], __ATOMIC_RELAXED);
+      if (__atomic_compare_exchange_n(&_top, &top, top + 1, false, __ATOMIC_SEQ_CST,
+                                      __ATOMIC_RELAXED)) {
+        return true;
+      }
+    }
+  }
 
-            if (_stop && _tasks.empty()) {
-              return;
-            }
+  size_t size() const noexcept {
+    const i64 bottom = __atomic_load_n(&_bottom, __ATOMIC_RELAXED);
+    const i64 top = __atomic_load_n(&_top, __ATOMIC_RELAXED);
+    return bottom > top ? static_cast<size_t>(bottom - top) : 0;
+  }
 
-            task = std::move(_tasks.front());
-            _tasks.pop();
-          }
+private:
+  static ring_t* _make_ring(size_t capacity, ring_t* prev) {
+    void* mem = ::malloc(sizeof(ring_t) + capacity * sizeof(T));
+    NTF_THROW_IF(!mem, BadAlloc());
+    ring_t* ring = static_cast<ring_t*>(mem);
+    ring->mask = static_cast<i64>(capacity) - 1;
+    ring->prev = prev;
+    ring->slots = reinterpret_cast<T*>(ring + 1);
+    return ring;
+  }
 
-          task();
-        }
-      });
+  ring_t* _grow(ring_t* ring, i64 top, i64 bottom) {
+    NTF_ASSERT(((ring->mask + 1) & ring->mask) == 0);
+    ring_t* new_ring = _make_ring(2 * static_cast<size_t>(ring->mask + 1), ring);
+    for (i64 i = top; i < bottom; ++i) {
+      new_ring->slots[i & new_ring->mask] =
+        __atomic_load_n(&ring->slots[i & ring->mask], __ATOMIC_RELAXED);
     }
+    __atomic_store_n(&_ring, new_ring, __ATOMIC_RELEASE);
+    return new_ring;
   }
 
-  ~ThreadPool() noexcept {
-    {
-      std::unique_lock<std::mutex> lock(_task_mtx);
-      _stop = true;
+private:
+  alignas(64) i64 _top{0};
+  alignas(64) i64 _bottom{0};
+  ring_t* _ring;
+};
+
+// FIFO queue in a circular buffer. Only allocates when it runs out of room, doubling its size.
+// Not thread safe
+template<typename T>
+class RingQueue {
+public:
+  explicit RingQueue(size_t capacity = 256) :
+      _slots(_allocate(capacity)), _mask(capacity - 1), _head(0), _tail(0) {
+    NTF_ASSERT(capacity && (capacity & (capacity - 1)) == 0, "Capacity has to be a power of two");
+  }
+
+  ~RingQueue() noexcept {
+    if constexpr (!meta::trivially_destructible<T>) {
+      for (size_t i = _head; i != _tail; ++i) {
+        _slots[i & _mask].~T();
+      }
     }
+    ::free(_slots);
+  }
+
+  NTF_NO_COPY(RingQueue);
+  NTF_NO_MOVE(RingQueue);
 
-    _cv.notify_all();
+public:
+  template<typename... Args>
+  void emplace(Args&&... args) {
+    if (_tail - _head > _mask) {
+      _grow();
+    }
+    NTF_PNEW(&_slots[_tail & _mask]) T(::ntf::forward<Args>(args)...);
+    ++_tail;
+  }
 
-    for (auto& thread : _threads) {
-      thread.join();
+  bool pop(T& out) noexcept {
+    if (_head == _tail) {
+      return false;
     }
+    T& elem = _slots[_head & _mask];
+    out = ::ntf::move(elem);
+    elem.~T();
+    ++_head;
+    return true;
   }
 
+  T& front() noexcept {
+    NTF_ASSERT(!empty());
+    return _slots[_head & _mask];
+  }
+
+  void pop_front() noexcept {
+    NTF_ASSERT(!empty());
+    _slots[_head & _mask].~T();
+    ++_head;
+  }
+
+  size_t size() const noexcept { return _tail - _head; }
+
+  bool empty() const noexcept { return _head == _tail; }
+
+private:
+  static T* _allocate(size_t capacity) {
+    T* slots = static_cast<T*>(::malloc(capacity * sizeof(T)));
+    NTF_THROW_IF(!slots, BadAlloc());
+    return slots;
+  }
+
+  void _grow() {
+    const size_t capacity = 2 * (_mask + 1);
+    T* slots = _allocate(capacity);
+    const size_t count = _tail - _head;
+    for (size_t i = 0; i < count; ++i) {
+      T& elem = _slots[(_head + i) & _mask];
+      NTF_PNEW(&slots[i]) T(::ntf::move(elem));
+      elem.~T();
+    }
+    ::free(_slots);
+    _slots = slots;
+    _mask = capacity - 1;
+    _head = 0;
+    _tail = count;
+  }
+
+private:
+  T* _slots;
+  size_t _mask;
+  size_t _head;
+  size_t _tail;
+};
+
+// Wraps callables too big for the task buffer
+template<typename F>
+class BoxedTask {
+public:
+  template<typename U>
+  explicit BoxedTask(U&& func) : _func(new F(::ntf::forward<U>(func))) {}
+
+  BoxedTask(BoxedTask&& other) noexcept : _func(other._func) { other._func = nullptr; }
+
+  ~BoxedTask() noexcept { delete _func; }
+
+  NTF_NO_COPY(BoxedTask);
+
 public:
-  void enqueue(task_type task) {
-    {
+  void operator()() { (*_func)(); }
+
+private:
+  F* _func;
+};
+
+// Result slot shared between a Future and the task filling it. The whole synchronization is a
+// single state word, also used as the futex waiters sleep on
+template<typename T, typename E>
+class FutureState {
+public:
+  using result_type = Expected<T, E>;
+
+  static constexpr u32 STATE_READY = 1u << 0;
+  static constexpr u32 STATE_WAITING = 1u << 1;
+
+public:
+  explicit FutureState(ThreadPool& pool) noexcept : _pool(&pool) {}
+
+  NTF_NO_COPY(FutureState);
+  NTF_NO_MOVE(FutureState);
+
+public:
+  template<typename... Args>
+  void set(Args&&... args) {
+    NTF_PNEW(_storage) result_type(::ntf::forward<Args>(args)...);
+    const u32 prev = __atomic_exchange_n(&_state, STATE_READY, __ATOMIC_ACQ_REL);
+    if (prev & STATE_WAITING) {
+      futex_wake(&_state, static_cast<u32>(INT32_MAX));
+    }
+  }
+
+  bool ready() const noexcept { return __atomic_load_n(&_state, __ATOMIC_ACQUIRE) & STATE_READY; }
+
+  // Workers of the pool run pending tasks meanwhile, the task might be sitting in their own deque
+  void wait() noexcept;
+
+  // Sleeps until the result is set, may return early on spurious wake ups
+  void wait_once() noexcept {
+    u32 state = __atomic_load_n(&_state, __ATOMIC_ACQUIRE);
+    while (!(state & STATE_READY)) {
+      if (!(state & STATE_WAITING) &&
+          !__atomic_compare_exchange_n(&_state, &state, state | STATE_WAITING, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        continue;
+      }
+      futex_wait(&_state, STATE_WAITING);
+      return;
+    }
+  }
+
+  result_type& result() noexcept {
+    NTF_ASSERT(ready());
+    return *::ntf::launder(reinterpret_cast<result_type*>(_storage));
+  }
+
+  // Both the future and the task hold a reference
+  void release() noexcept {
+    if (__atomic_sub_fetch(&_refs, 1, __ATOMIC_ACQ_REL)) {
+      return;
+    }
+    if (__atomic_load_n(&_state, __ATOMIC_RELAXED) & STATE_READY) {
+      result().~result_type();
+    }
+    delete this;
+  }
+
+private:
+  ThreadPool* _pool;
+  u32 _state{0};
+  u32 _refs{2};
+  alignas(result_type) u8 _storage[sizeof(result_type)];
+};
+
+template<typename R>
+struct future_traits {
+  using value_type = R;
+  using error_type = TaskError;
+};
+
+template<typename T, typename E>
+struct future_traits<Expected<T, E>> {
+  using value_type = T;
+  using error_type = E;
+};
+
+} // namespace impl
+
+// Handle to the result of a task enqueued with ThreadPool::enqueue(with_future, ...)
+template<typename T, typename E = TaskError>
+class Future {
+public:
+  using value_type = T;
+  using error_type = E;
+  using result_type = Expected<T, E>;
+  using state_type = impl::FutureState<T, E>;
+
+public:
+  Future() noexcept : _state(nullptr) {}
+
+  explicit Future(state_type* state) noexcept : _state(state) {}
+
+  Future(Future&& other) noexcept : _state(other._state) { other._state = nullptr; }
+
+  ~Future() noexcept {
+    if (_state) {
+      _state->release();
+    }
+  }
+
+  NTF_NO_COPY(Future);
+
+public:
+  Future& operator=(Future&& other) noexcept {
+    if (this != &other) {
+      if (_state) {
+        _state->release();
+      }
+      _state = other._state;
+      other._state = nullptr;
+    }
+    return *this;
+  }
+
+public:
+  bool valid() const noexcept { return _state != nullptr; }
+
+  bool ready() const noexcept {
+    NTF_ASSERT(_state, "Invalid future");
+    return _state->ready();
+  }
+
+  // Called from a worker of the pool, runs other tasks while waiting
+  void wait() const noexcept {
+    NTF_ASSERT(_state, "Invalid future");
+    _state->wait();
+  }
+
+  // Blocks until the task finishes. The result lives as long as the future
+  result_type& get() noexcept {
+    wait();
+    return _state->result();
+  }
+
+  const result_type& get() const noexcept { return const_cast<Future&>(*this).get(); }
+
+private:
+  state_type* _state;
+};
+
+namespace impl {
+
+template<typename F>
+using task_result_t = meta::remove_cvref_t<meta::invoke_result_t<meta::remove_cvref_t<F>&>>;
+
+template<typename F>
+using future_for = Future<typename future_traits<task_result_t<F>>::value_type,
+                          typename future_traits<task_result_t<F>>::error_type>;
+
+template<typename F, typename T, typename E>
+class FutureTask {
+private:
+  using ret_type = meta::remove_cvref_t<meta::invoke_result_t<F&>>;
+
+public:
+  template<typename U>
+  FutureTask(FutureState<T, E>* state, U&& func) :
+      _state(state), _func(::ntf::forward<U>(func)) {}
+
+  FutureTask(FutureTask&& other) noexcept :
+      _state(other._state), _func(::ntf::move(other._func)) {
+    other._state = nullptr;
+  }
+
+  ~FutureTask() noexcept {
+    if (_state) {
+      _state->release();
+    }
+  }
+
+  NTF_NO_COPY(FutureTask);
+
+public:
+  void operator()() {
+#ifdef __cpp_exceptions
+    if constexpr (meta::is_same_v<E, TaskError> && !meta::expected_type<ret_type>) {
+      try {
+        _run();
+      } catch (...) {
+        _state->set(unexpect, TaskError::exception);
+      }
+      return;
+    }
+#endif
+    _run();
+  }
+
+private:
+  void _run() {
+    if constexpr (meta::expected_type<ret_type>) {
+      _state->set(_func());
+    } else if constexpr (meta::is_void_v<ret_type>) {
+      _func();
+      _state->set();
+    } else {
+      _state->set(_func());
+    }
+  }
+
+private:
+  FutureState<T, E>* _state;
+  F _func;
+};
+
+} // namespace impl
+
+// Waits for every future, returns true if all of them hold a value. Helps like Future::wait
+template<typename T, typename E, size_t Extent>
+bool when_all(Span<Future<T, E>, Extent> futures) noexcept {
+  bool all_values = true;
+  for (auto& future : futures) {
+    all_values &= future.get().has_value();
+  }
+  return all_values;
+}
+
+struct ThreadPoolConfig {
+  // Idle workers poll for this many rounds, pausing between them, before yielding their CPU
+  u32 spin_count = 64;
+  // Rounds of sched_yield after spinning, before sleeping on the futex
+  u32 yield_count = 4;
+  // Pins worker i to cpus[i % size], overriding the placement from POOL_PIN_WORKERS. Only read
+  // by the constructor
+  Span<const u32> cpus{};
+  // Every aging_ns a task waits, it competes as if it were one lane higher, so lower lanes never
+  // starve. 0 disables aging
+  u64 aging_ns = 10'000'000;
+};
+
+// Only tracked when built with NTF_THREADPOOL_STATS, except for `backlog` and `sleeping`
+struct ThreadPoolStats {
+  static constexpr u32 HIST_BUCKETS = 32;
+
+  u64 executed;
+  u64 steals;
+  u64 steal_misses; // Passes over every victim that found nothing
+  u64 busy_ns;      // Running tasks, not counting tasks they ran while waiting
+  u64 idle_ns;      // Between tasks, sleep_ns included
+  u64 sleep_ns;
+  u64 sleeps;
+  i64 backlog;  // Tasks enqueued and not started yet
+  u32 sleeping; // Workers sleeping right now
+  // Bucket i counts durations in [2^i, 2^(i+1)) ns, the last one takes everything longer
+  u64 wait_hist[HIST_BUCKETS]; // From enqueue to start
+  u64 run_hist[HIST_BUCKETS]; // Same exclusive time as busy_ns
+
+  // Upper bound of the bucket reaching the given fraction of the samples, 0.99 for the p99
+  static u64 percentile(const u64 (&hist)[HIST_BUCKETS], double fraction) noexcept;
+};
+
+class ThreadPool {
+public:
+  using task_type = InplaceFn<void(), NTF_THREADPOOL_TASK_SIZE>;
+
+public:
+  ThreadPool(std::size_t n_threads = std::thread::hardware_concurrency(),
+             u32 flags = POOL_SHARED_QUEUE, const ThreadPoolConfig& config = {});
+
+  ~ThreadPool() noexcept;
+
+public:
+  // Normal priority tasks enqueued from a worker go to its own deque, everything else goes through
+  // the shared lanes
+  void enqueue(TaskPriority priority, task_type&& task);
+
+  void enqueue(task_type&& task) { enqueue(TaskPriority::normal, ::ntf::move(task)); }
+
+  template<typename F>
+  requires(!meta::is_same_v<meta::remove_cvref_t<F>, task_type> && meta::invocable_with<F>)
+  void enqueue(TaskPriority priority, F&& func) {
+    enqueue(priority, _make_task(::ntf::forward<F>(func)));
+  }
+
+  template<typename F>
+  requires(!meta::is_same_v<meta::remove_cvref_t<F>, task_type> && meta::invocable_with<F>)
+  void enqueue(F&& func) {
+    enqueue(TaskPriority::normal, _make_task(::ntf::forward<F>(func)));
+  }
+
+  // Deadline tasks run before every lane, earliest deadline first. The deadline is a
+  // monotonic_ns() timestamp
+  void enqueue_deadline(u64 deadline_ns, task_type&& task);
+
+  template<typename F>
+  requires(!meta::is_same_v<meta::remove_cvref_t<F>, task_type> && meta::invocable_with<F>)
+  void enqueue_deadline(u64 deadline_ns, F&& func) {
+    enqueue_deadline(deadline_ns, _make_task(::ntf::forward<F>(func)));
+  }
+
+  // Enqueues every task with a single lock (or none from a worker) and wakes at most as many
+  // sleeping workers as tasks. The tasks get moved from
+  void enqueue_bulk(Span<task_type> tasks, TaskPriority priority = TaskPriority::normal) {
+    _enqueue_bulk(tasks.size(), priority,
+                  [&](size_t i) -> task_type&& { return ::ntf::move(tasks[i]); });
+  }
+
+  // Same, but copies each callable into its task
+  template<typename F>
+  requires(!meta::is_same_v<meta::remove_cv_t<F>, task_type> && meta::invocable_with<F&>)
+  void enqueue_bulk(Span<F> funcs, TaskPriority priority = TaskPriority::normal) {
+    _enqueue_bulk(funcs.size(), priority, [&](size_t i) { return _make_task(funcs[i]); });
+  }
+
+  template<typename F>
+  requires(meta::invocable_with<meta::remove_cvref_t<F>&>)
+  impl::future_for<F> enqueue(with_future_t, F&& func) {
+    using future_type = impl::future_for<F>;
+    using value_type = typename future_type::value_type;
+    using error_type = typename future_type::error_type;
+    auto* state = new typename future_type::state_type(*this);
+    enqueue(impl::FutureTask<meta::remove_cvref_t<F>, value_type, error_type>{
+      state, ::ntf::forward<F>(func)});
+    return future_type{state};
+  }
+
+  // Runs one pending task in the calling thread, if there is any. Lets threads waiting on
+  // results help instead of blocking
+  bool try_run_one();
+
+  size_t size() const noexcept { return _worker_count; }
+
+  u32 flags() const noexcept { return _flags; }
+
+  // True when called from one of the workers of this pool
+  bool on_worker() const noexcept;
+
+  // Every worker added up, plus the tasks other threads ran through try_run_one
+  ThreadPoolStats stats() const noexcept;
+
+  // Counters of a single worker, backlog and sleeping are still pool wide
+  ThreadPoolStats worker_stats(u32 index) const noexcept;
+
+private:
+  using task_pool = ConcurrentFixedFreelist<task_type, NTF_THREADPOOL_LOCAL_TASKS>;
+  using task_slot = task_pool::element_slot;
+
+  static constexpr u32 STEAL_TIERS = 4;
+  static constexpr u32 PRIORITY_COUNT = 3;
+  // Local pops in a row before a worker checks the lanes first, so a deque that never runs dry
+  // can't starve them. Only lanes that rank as normal after aging go ahead of the deque
+  static constexpr u32 LANE_POLL_INTERVAL = 64;
+
+  struct lane_entry {
+    task_type task;
+    u64 enqueued; // Only set with aging or NTF_THREADPOOL_STATS
+
+    lane_entry(task_type&& task_, u64 enqueued_) noexcept :
+        task(::ntf::move(task_)), enqueued(enqueued_) {}
+  };
+
+  struct deadline_entry {
+    u64 deadline;
+    task_type task;
+    u64 enqueued; // Only set with NTF_THREADPOOL_STATS
+  };
+
+#ifdef NTF_THREADPOOL_STATS
+  struct alignas(64) stats_t {
+    ThreadPoolStats stats{};
+  };
+#endif
+
+  struct alignas(64) worker_t {
+    impl::WorkDeque<task_slot> deque;
+    u32 rng;
+    u32 local_streak{0}; // Tasks popped from the deque since the lanes were last checked
+    // Other workers by distance to this one, only when pinned
+    std::vector<u32> victims;
+    u32 tier_end[STEAL_TIERS];
+  };
+
+  template<typename F>
+  static task_type _make_task(F&& func) {
+    if constexpr (task_type::can_hold<F>) {
+      return task_type{::ntf::forward<F>(func)};
+    } else {
+      return task_type{impl::BoxedTask<meta::remove_cvref_t<F>>{::ntf::forward<F>(func)}};
+    }
+  }
+
+  template<typename Make>
+  void _enqueue_bulk(size_t count, TaskPriority priority, Make&& make) {
+    if (!count) {
+      return;
+    }
+    __atomic_add_fetch(&_pending, static_cast<i64>(count), __ATOMIC_SEQ_CST);
+    size_t i = 0;
+    const u32 worker = priority == TaskPriority::normal ? _local_worker() : NO_WORKER;
+    if (worker != NO_WORKER) {
+      for (; i < count; ++i) {
+        // Doesn't consume the task when there are no free slots
+        const task_slot slot = _local_tasks->try_emplace(make(i));
+        if (slot == task_pool::null_slot) {
+          break;
+        }
+        _stamp_slot(slot);
+        _workers[worker].deque.push(slot);
+      }
+    }
+    if (i < count) {
+      const u64 now = _enqueue_time();
+      auto& lane = _lanes[static_cast<u32>(priority)];
       std::unique_lock<std::mutex> lock(_task_mtx);
-      _tasks.emplace(std::move(task));
+      __atomic_add_fetch(&_injected, static_cast<u32>(count - i), __ATOMIC_RELAXED);
+      if (priority == TaskPriority::high) {
+        __atomic_add_fetch(&_urgent, static_cast<u32>(count - i), __ATOMIC_RELAXED);
+      }
+      for (; i < count; ++i) {
+        lane.emplace(task_type{make(i)}, now);
+      }
     }
-    _cv.notify_one();
+    _wake(count);
+  }
+
+  static constexpr u32 NO_WORKER = static_cast<u32>(-1);
+
+  // Only read the clock when aging or the stats need it
+  u64 _enqueue_time() const noexcept {
+#ifdef NTF_THREADPOOL_STATS
+    return monotonic_ns();
+#else
+    return _config.aging_ns ? monotonic_ns() : 0;
+#endif
+  }
+
+  void _stamp_slot(task_slot slot) noexcept {
+#ifdef NTF_THREADPOOL_STATS
+    __atomic_store_n(&_slot_times[slot], monotonic_ns(), __ATOMIC_RELAXED);
+#else
+    NTF_UNUSED(slot);
+#endif
   }
 
+  // Index of the calling thread if it is a worker of this pool in work stealing mode
+  u32 _local_worker() const noexcept;
+
+  void _worker_loop(u32 index);
+  bool _find_task(u32 index, task_type& task);
+  // Only takes lanes ranking at or above max_rank after aging, deadlines always qualify
+  bool _pop_injected(task_type& task, u32 max_rank = PRIORITY_COUNT);
+  bool _steal(u32 thief, u32& rng, task_type& task);
+  void _take_slot(task_slot slot, task_type& task);
+  void _place_workers(const ThreadPoolConfig& config);
+  bool _wait_for_task(u32 index, task_type& task);
+  void _wake(size_t count);
+  u64 _run_task(u32 slot, task_type& task, u64 idle_from);
+  ThreadPoolStats _read_stats(u32 first, u32 last) const noexcept;
+
 private:
+  u32 _flags;
+  u32 _worker_count;
   bool _stop{false};
+  i64 _pending{0};  // Tasks sitting in any queue
+  u32 _sleeping{0}; // Workers about to sleep or sleeping on _wake_seq
+  u32 _wake_seq{0}; // Futex word, bumped on every wake up
+  u32 _injected{0}; // Tasks in the lanes and deadline heap, readable without the lock
+  u32 _urgent{0};   // Tasks in the high lane and deadline heap, checked before the local deque
 
+  worker_t* _workers{nullptr};
+  task_pool* _local_tasks{nullptr};
   std::vector<std::thread> _threads;
 
-  std::queue<task_type> _tasks;
+  impl::RingQueue<lane_entry> _lanes[PRIORITY_COUNT];
+  std::vector<deadline_entry> _deadlines; // Min heap
   std::mutex _task_mtx;
-  std::condition_variable _cv;
+  ThreadPoolConfig _config;
+  std::vector<CpuInfo> _cpus; // Where each worker is pinned, empty if they aren't
+#ifdef NTF_THREADPOOL_STATS
+  stats_t* _stats{nullptr}; // One per worker, the last one for every other thread
+  u64* _slot_times{nullptr}; // Enqueue time of every local task slot
+#endif
 
 public:
   NTF_NO_MOVE(ThreadPool);
   NTF_NO_COPY(ThreadPool);
 };
 
+namespace impl {
+
+// Runs pending pool tasks until the counter drops to zero, sleeps on it when there are none. A
+// task throwing here terminates, same as it would on a worker
+inline void help_while_pending(ThreadPool& pool, u32& pending) noexcept {
+  u32 value;
+  while ((value = __atomic_load_n(&pending, __ATOMIC_ACQUIRE))) {
+    if (!pool.try_run_one()) {
+      futex_wait(&pending, value);
+    }
+  }
+}
+
+inline void release_pending(u32& pending) noexcept {
+  if (!__atomic_sub_fetch(&pending, 1, __ATOMIC_ACQ_REL)) {
+    futex_wake(&pending, 1);
+  }
+}
+
+template<typename T, typename E>
+void FutureState<T, E>::wait() noexcept {
+  if (_pool->on_worker()) {
+    while (!ready()) {
+      if (!_pool->try_run_one()) {
+        wait_once();
+      }
+    }
+    return;
+  }
+  while (!ready()) {
+    wait_once();
+  }
+}
+
+constexpr size_t cache_line_size = 64;
+
+// Splits a range in blocks of `grain` elements. When the elements pack evenly in cache lines, the
+// grain is rounded to whole lines and every block but the first starts on a line boundary, so
+// neighbouring blocks never write to the same line
+struct ParallelBlocks {
+  size_t size;
+  size_t head; // Size of the first block when the range doesn't start on a line boundary
+  size_t grain;
+
+  template<typename T>
+  static ParallelBlocks make(Span<T> data, size_t grain, size_t workers) noexcept {
+    ParallelBlocks blocks{data.size(), 0, grain};
+    if (!blocks.grain) {
+      blocks.grain = data.size() / (4 * workers);
+    }
+    if (!blocks.grain) {
+      blocks.grain = 1;
+    }
+    if constexpr (cache_line_size % sizeof(T) == 0) {
+      constexpr size_t line_elems = cache_line_size / sizeof(T);
+      blocks.grain = (blocks.grain + line_elems - 1) / line_elems * line_elems;
+      uintptr_t addr;
+      T* ptr = data.data();
+      memcpy(&addr, &ptr, sizeof(addr));
+      if (addr % sizeof(T) == 0) {
+        blocks.head = ((cache_line_size - addr % cache_line_size) % cache_line_size) / sizeof(T);
+      }
+      if (blocks.head >= blocks.size) {
+        blocks.head = 0;
+      }
+    }
+    return blocks;
+  }
+
+  size_t count() const noexcept {
+    if (!size) {
+      return 0;
+    }
+    return (head ? 1 : 0) + (size - head + grain - 1) / grain;
+  }
+
+  size_t begin(size_t block) const noexcept {
+    if (!head) {
+      return block * grain;
+    }
+    return block ? head + (block - 1) * grain : 0;
+  }
+
+  size_t end(size_t block) const noexcept {
+    const size_t next = begin(block + 1);
+    return next < size ? next : size;
+  }
+};
+
+// Runs fn(block) for every block index. Ranges get halved recursively, the caller keeps the first
+// half and enqueues the second one, then helps with pending tasks until every block is done.
+// Enqueued halves point into the caller's frame, so if the caller throws it still waits for all of
+// them before rethrowing
+template<typename F>
+class ParallelSplit {
+public:
+  ParallelSplit(ThreadPool& pool, F& func) noexcept : _pool(pool), _func(func) {}
+
+  NTF_NO_COPY(ParallelSplit);
+  NTF_NO_MOVE(ParallelSplit);
+
+public:
+  void run(size_t block_count) {
+    if (!block_count) {
+      return;
+    }
+#ifdef __cpp_exceptions
+    try {
+      _split(0, block_count);
+    } catch (...) {
+      help_while_pending(_pool, _pending);
+      throw;
+    }
+#else
+    _split(0, block_count);
+#endif
+    help_while_pending(_pool, _pending);
+  }
+
+private:
+  void _split(size_t first, size_t last) {
+    while (last - first > 1) {
+      const size_t mid = first + (last - first) / 2;
+      __atomic_add_fetch(&_pending, 1, __ATOMIC_RELAXED);
+#ifdef __cpp_exceptions
+      try {
+#endif
+        // Throwing from a worker terminates, like any other task
+        _pool.enqueue([this, mid, last]() noexcept {
+          _split(mid, last);
+          release_pending(_pending);
+        });
+#ifdef __cpp_exceptions
+      } catch (...) {
+        __atomic_sub_fetch(&_pending, 1, __ATOMIC_RELAXED);
+        throw;
+      }
+#endif
+      last = mid;
+    }
+    _func(first);
+  }
+
+private:
+  ThreadPool& _pool;
+  F& _func;
+  u32 _pending{0};
+};
+
+} // namespace impl
+
+// Calls fn for every element, or for every block if fn takes a Span. A grain of 0 picks one
+// based on the worker count
+template<typename T, size_t Extent, typename F>
+void parallel_for(ThreadPool& pool, Span<T, Extent> data, size_t grain, F&& fn) {
+  const auto blocks = impl::ParallelBlocks::make(Span<T>{data}, grain, pool.size());
+  auto run_block = [&](size_t block) {
+    Span<T> chunk{data.data() + blocks.begin(block), blocks.end(block) - blocks.begin(block)};
+    if constexpr (meta::invocable_with<F&, Span<T>>) {
+      fn(chunk);
+    } else {
+      for (T& elem : chunk) {
+        fn(elem);
+      }
+    }
+  };
+  impl::ParallelSplit<decltype(run_block)> split{pool, run_block};
+  split.run(blocks.count());
+}
+
+// Folds map(elem) with combine, starting from init. Blocks get reduced in parallel and their
+// results combined in order, so combine only needs to be associative. The block results live in
+// the caller's scratch arena, pass any arena map or combine allocate from as a conflict
+template<typename T, size_t Extent, typename R, typename Map, typename Combine>
+R parallel_reduce(ThreadPool& pool, Span<T, Extent> data, R init, Map&& map, Combine&& combine,
+                  size_t grain = 0, Span<const ntf_Arena> conflicts = {}) {
+  const auto blocks = impl::ParallelBlocks::make(Span<T>{data}, grain, pool.size());
+  const size_t count = blocks.count();
+  if (!count) {
+    return init;
+  }
+
+  struct alignas(impl::cache_line_size) partial_t {
+    alignas(R) u8 storage[sizeof(R)];
+    bool done;
+  };
+  ScratchArena scratch{conflicts.data(), conflicts.size()};
+  auto* partials =
+    static_cast<partial_t*>(scratch.allocate(count * sizeof(partial_t), alignof(partial_t)));
+  for (size_t i = 0; i < count; ++i) {
+    partials[i].done = false;
+  }
+
+  auto run_block = [&](size_t block) {
+    T* it = data.data() + blocks.begin(block);
+    T* const last = data.data() + blocks.end(block);
+    R acc(map(*it));
+    while (++it != last) {
+      acc = combine(::ntf::move(acc), map(*it));
+    }
+    NTF_PNEW(partials[block].storage) R(::ntf::move(acc));
+    partials[block].done = true;
+  };
+  impl::ParallelSplit<decltype(run_block)> split{pool, run_block};
+#ifdef __cpp_exceptions
+  try {
+    split.run(count);
+  } catch (...) {
+    for (size_t i = 0; i < count; ++i) {
+      if (partials[i].done) {
+        ::ntf::launder(reinterpret_cast<R*>(partials[i].storage))->~R();
+      }
+    }
+    throw;
+  }
+#else
+  split.run(count);
+#endif
+
+  for (size_t i = 0; i < count; ++i) {
+    R* partial = ::ntf::launder(reinterpret_cast<R*>(partials[i].storage));
+    init = combine(::ntf::move(init), ::ntf::move(*partial));
+    partial->~R();
+  }
+  return init;
+}
+
+// Tasks with dependencies, declared once and run as many times as needed. Every node keeps an
+// atomic count of unfinished dependencies, the node that drops a successor's count to zero runs it
+// right away or hands it to the pool. There is no central scheduler
+class TaskGraph {
+public:
+  using task_type = ThreadPool::task_type;
+  using node_id = u32;
+
+public:
+  TaskGraph() = default;
+
+  NTF_NO_COPY(TaskGraph);
+  NTF_NO_MOVE(TaskGraph);
+
+public:
+  template<typename F>
+  requires(meta::invocable_with<meta::remove_cvref_t<F>&>)
+  node_id add_node(F&& func) {
+    NTF_ASSERT(!_running, "Modifying a running TaskGraph");
+    if constexpr (task_type::can_hold<F>) {
+      _nodes.push_back(node_t{task_type{::ntf::forward<F>(func)}});
+    } else {
+      _nodes.push_back(
+        node_t{task_type{impl::BoxedTask<meta::remove_cvref_t<F>>{::ntf::forward<F>(func)}}});
+    }
+    _compiled = false;
+    return static_cast<node_id>(_nodes.size() - 1);
+  }
+
+  // `after` won't start until `before` finishes
+  void add_edge(node_id before, node_id after);
+
+  // Blocks until every node ran, the calling thread helps the pool meanwhile
+  void run(ThreadPool& pool);
+
+  size_t size() const noexcept { return _nodes.size(); }
+
+private:
+  struct node_t {
+    task_type func;
+    u32 deps{0};    // Edges coming in
+    u32 pending{0}; // Unfinished dependencies in the current run
+    u32 succ_first{0};
+    u32 succ_count{0};
+  };
+
+  void _compile();
+  void _run_node(node_id node);
+
+private:
+  std::vector<node_t> _nodes;
+  std::vector<std::pair<node_id, node_id>> _edges;
+  std::vector<node_id> _succs; // Successors of every node, grouped by node
+  std::vector<node_id> _roots;
+  ThreadPool* _pool{nullptr};
+  u32 _remaining{0};
+  bool _compiled{false};
+  bool _running{false};
+};
+
+// Hierarchical timing wheel. Every level has 64 slots, each slot of a level spanning a whole turn
+// of the level below it, so inserting and cancelling a timer is a list link and unlink. A timer
+// sits in the level of the highest tick digit where its expiry differs from the current tick and
+// moves down when that level reaches its slot. A single thread drives the wheel, sleeping until
+// the next non empty slot, and hands expired tasks to the pool in bulk
+class TimerWheel {
+public:
+  using task_type = ThreadPool::task_type;
+  using timer_id = SlotHandle;
+
+  static constexpr timer_id null_timer{static_cast<FreelistSlot>(-1), 0};
+
+public:
+  // Timers fire at most tick_ns late, plus the time the pool takes to get to them
+  explicit TimerWheel(ThreadPool& pool, u64 tick_ns = 1'000'000,
+                      TaskPriority priority = TaskPriority::normal);
+
+  // Pending timers get dropped without running
+  ~TimerWheel() noexcept;
+
+  NTF_NO_COPY(TimerWheel);
+  NTF_NO_MOVE(TimerWheel);
+
+public:
+  // Runs the task in the pool after delay_ns, never before
+  timer_id schedule(u64 delay_ns, task_type&& task) {
+    return schedule_at(monotonic_ns() + delay_ns, ::ntf::move(task));
+  }
+
+  template<typename F>
+  requires(!meta::is_same_v<meta::remove_cvref_t<F>, task_type> && meta::invocable_with<F>)
+  timer_id schedule(u64 delay_ns, F&& func) {
+    return schedule(delay_ns, _make_task(::ntf::forward<F>(func)));
+  }
+
+  // Same, at a monotonic_ns() timestamp
+  timer_id schedule_at(u64 deadline_ns, task_type&& task);
+
+  template<typename F>
+  requires(!meta::is_same_v<meta::remove_cvref_t<F>, task_type> && meta::invocable_with<F>)
+  timer_id schedule_at(u64 deadline_ns, F&& func) {
+    return schedule_at(deadline_ns, _make_task(::ntf::forward<F>(func)));
+  }
+
+  // Returns false if the timer already fired or was cancelled, the task won't run otherwise
+  bool cancel(timer_id timer);
+
+  // Timers not handed to the pool yet
+  size_t size() const;
+
+  u64 tick_ns() const noexcept { return _tick_ns; }
+
+private:
+  static constexpr u32 LEVEL_BITS = 6;
+  static constexpr u32 LEVEL_SLOTS = 1u << LEVEL_BITS;
+  static constexpr u32 LEVELS = 6;
+  // Timers differing from the current tick above the top level wait in an extra list
+  static constexpr u32 OVERFLOW_SLOT = LEVELS * LEVEL_SLOTS;
+  static constexpr u64 NO_TICK = static_cast<u64>(-1);
+
+  struct entry_t {
+    task_type task;
+    u64 expiry; // Tick
+    timer_id prev;
+    timer_id next;
+    u32 slot;
+  };
+
+  template<typename F>
+  static task_type _make_task(F&& func) {
+    if constexpr (task_type::can_hold<F>) {
+      return task_type{::ntf::forward<F>(func)};
+    } else {
+      return task_type{impl::BoxedTask<meta::remove_cvref_t<F>>{::ntf::forward<F>(func)}};
+    }
+  }
+
+  void _timer_loop();
+  void _link(timer_id timer, entry_t& entry);
+  void _unlink(entry_t& entry);
+  void _cascade(u32 slot);
+  void _expire(u32 slot);
+  void _advance(u64 tick);
+  u64 _next_event() const noexcept;
+
+private:
+  ThreadPool& _pool;
+  u64 _tick_ns;
+  u64 _start;        // monotonic_ns() at tick 0
+  u64 _now{0};       // Last tick processed
+  u64 _wake_tick{0}; // Tick the timer thread sleeps until
+  u32 _wake_seq{0};  // Futex word, bumped when a timer needs an earlier wake up
+  bool _stop{false};
+  TaskPriority _priority;
+
+  SlotMap<entry_t> _timers;
+  timer_id _slots[LEVELS * LEVEL_SLOTS + 1];
+  u64 _occupied[LEVELS]{}; // Non empty slots of each level
+  std::vector<task_type> _expired;
+  mutable std::mutex _mtx;
+  std::thread _thread;
+};
+
 } // namespace ntf
 
 #endif // NTF_THREADPOOL_HPP_
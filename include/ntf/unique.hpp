@@ -118,7 +118,7 @@ public:
   }
 
   constexpr UniquePtr(UniquePtr&& other) noexcept(meta::nothrow_copy_constructible<Deleter>) :
-      Deleter(other.deleter()), _ptr(other._ptr) {
+      Deleter(static_cast<Deleter&&>(other)), _ptr(other._ptr) {
     other._ptr = nullptr;
   }
 
@@ -155,7 +155,7 @@ public:
     }
 
     Deleter::operator=(static_cast<Deleter&&>(other));
-    _ptr = nullptr;
+    _ptr = other._ptr;
 
     other._ptr = nullptr;
 
@@ -188,6 +188,7 @@ template<typename T, meta::alloc_arg<T> Alloc, typename... Args>
 requires(meta::constructible_from<T, Args...>)
 auto make_unique(alloc_arg_t, Alloc&& alloc, Args&&... args)
   -> UniquePtr<T, AllocDelete<meta::remove_cvref_t<Alloc>>> {
+  AllocDelete<meta::remove_cvref_t<Alloc>> deleter{alloc};
   T* ptr = alloc.allocate(1);
 #ifdef __cpp_exceptions
   try {
@@ -199,7 +200,7 @@ auto make_unique(alloc_arg_t, Alloc&& alloc, Args&&... args)
     throw;
   }
 #endif
-  return ptr;
+  return UniquePtr<T, AllocDelete<meta::remove_cvref_t<Alloc>>>(ptr, deleter);
 }
 
 template<typename T, meta::mem_arg<T> Mem, typename... Args>
@@ -259,7 +260,7 @@ public:
       Deleter(del), _data{arr}, _count{n} {}
 
   UniqueArray(UniqueArray&& other) noexcept(meta::nothrow_move_constructible<Deleter>) :
-      Deleter(other.deleter()), _data{other._data}, _count{other._count} {
+      Deleter(static_cast<Deleter&&>(other)), _data{other._data}, _count{other._count} {
     other._data = nullptr;
     other._count = 0;
   }
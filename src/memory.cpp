@@ -1,6 +1,5 @@
 #include <ntf/memory.hpp>
 
-#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -15,17 +14,27 @@ size_t ntf_system_page_size() noexcept {
 namespace {
 
 const size_t MinArenaSize = 4 * 1024 * ntf_system_page_size(); // 16MiB when page_size == 4KiB
+const size_t ScratchArenaSize = 256 * ntf_system_page_size(); // 1MiB when page_size == 4KiB
+const size_t HugePageSize = 2 * 1024 * 1024;
+const size_t DefaultCommitStep = 512 * ntf_system_page_size(); // 2MiB when page_size == 4KiB
+
+struct ArenaBlock {
+  ArenaBlock* next;
+  size_t size; // Size of the whole mapping, header included
+};
+
+size_t align_size(size_t sz, size_t align) noexcept {
+  return align * ((sz + align - 1) / align);
+}
 
 size_t next_page_size(size_t sz) noexcept {
-  // Allocate one extra memory page just in case
-  const size_t page_size = ntf_system_page_size();
-  return page_size * (size_t)ceilf((float)sz / (float)page_size);
+  return align_size(sz, ntf_system_page_size());
 }
 
 size_t align_fw_adjust(void* ptr, size_t align) noexcept {
   uintptr_t p;
   memcpy(&p, &ptr, sizeof(p));
-  return align - (p & (align - 1));
+  return (align - (p & (align - 1))) & (align - 1);
 }
 
 void* ptr_add(void* ptr, size_t sz) noexcept {
@@ -36,26 +45,278 @@ void* ptr_add(void* ptr, size_t sz) noexcept {
   return ptr;
 }
 
+void* map_aligned(size_t size, size_t align, int prot, int map_flags) noexcept {
+  // Over map and trim both ends to get an aligned range
+  void* ptr = mmap(nullptr, size + align, prot, map_flags, -1, 0);
+  if (ptr == MAP_FAILED) {
+    return nullptr;
+  }
+  const size_t head = align_fw_adjust(ptr, align);
+  if (head) {
+    int ret = munmap(ptr, head);
+    NTF_UNUSED(ret);
+  }
+  const size_t tail = align - head;
+  if (tail) {
+    int ret = munmap(ptr_add(ptr, head + size), tail);
+    NTF_UNUSED(ret);
+  }
+  return ptr_add(ptr, head);
+}
+
+// Maps a block following the arena page flags. `size` gets rounded up to the page size used
+void* map_block(size_t& size, uint32_t flags, ntf_ArenaPageMode& mode) noexcept {
+  const bool reserve = flags & NTF_ARENA_RESERVE;
+  const int prot = reserve ? PROT_NONE : PROT_READ | PROT_WRITE;
+  const int map_flags = MAP_ANON | MAP_PRIVATE | (reserve ? MAP_NORESERVE : 0);
+
+  // Reserved ranges could SIGBUS on commit if the hugetlbfs pool runs dry, so they only use THP
+  if ((flags & NTF_ARENA_HUGETLB) && !reserve) {
+    const size_t huge_size = align_size(size, HugePageSize);
+    void* ptr = mmap(nullptr, huge_size, prot, map_flags | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+      size = huge_size;
+      mode = NTF_ARENA_PAGES_HUGETLB;
+      return ptr;
+    }
+    // No hugetlbfs pages available, fall back to whatever else was requested
+  }
+
+  if (flags & NTF_ARENA_HUGEPAGE) {
+    const size_t huge_size = align_size(size, HugePageSize);
+    void* ptr = map_aligned(huge_size, HugePageSize, prot, map_flags);
+    if (!ptr) {
+      return nullptr;
+    }
+    size = huge_size;
+    mode = madvise(ptr, huge_size, MADV_HUGEPAGE) ? NTF_ARENA_PAGES_NORMAL
+                                                   : NTF_ARENA_PAGES_TRANSPARENT;
+    return ptr;
+  }
+
+  void* ptr = mmap(nullptr, size, prot, map_flags, -1, 0);
+  if (ptr == MAP_FAILED) {
+    return nullptr;
+  }
+  mode = NTF_ARENA_PAGES_NORMAL;
+  return ptr;
+}
+
+void unmap_chain(ArenaBlock* block) noexcept {
+  while (block) {
+    ArenaBlock* next = block->next;
+    int ret = munmap(block, block->size);
+    NTF_UNUSED(ret);
+    block = next;
+  }
+}
+
 } // namespace
 
+#ifdef NTF_ARENA_STATS
+#define NTF_ARENA_STAT(_expr) _expr
+#else
+#define NTF_ARENA_STAT(_expr) NTF_NOOP
+#endif
+
 struct ntf_Arena_T {
-  size_t mapping_size;
-  size_t used;
+  ArenaBlock root;    // The mapping holding this header, always the first block in the chain
+  ArenaBlock* block;  // Block currently being bumped
+  size_t used;        // Bump offset inside the current block, header included
+  size_t total;       // Bytes handed out across the whole chain, padding included
+  size_t peak;        // High water mark of `total` since the last clear
+  size_t retained;    // Decayed high water mark, memory below it survives clears
+  size_t min_retain;
+  uint32_t decay_shift;
+  size_t committed;   // Accessible bytes in the root block, equal to its size unless reserved
+  size_t commit_step;
+  uint32_t flags;
+  ntf_ArenaPageMode page_mode; // Weakest page mode among all mapped blocks
+  ntf_ArenaClearPolicy clear_policy;
+#ifdef NTF_ARENA_STATS
+  ntf_ArenaStats stats;
+#endif
+
+  size_t block_start(const ArenaBlock* blk) const {
+    return blk == &root ? sizeof(ntf_Arena_T) : sizeof(ArenaBlock);
+  }
+
+  size_t block_limit() const { return block == &root ? committed : block->size; }
+
+  void* head(size_t pad = 0) { return ptr_add(block, used + pad); }
 
-  void* head(size_t pad = 0) { return ptr_add(this + sizeof(*this), used + pad); }
+  void bump(size_t size) noexcept {
+    used += size;
+    total += size;
+    peak = ntf::max(peak, total);
+    NTF_ARENA_STAT(stats.peak = ntf::max(stats.peak, total));
+  }
+
+  bool is_last(void* ptr, size_t size) noexcept { return ptr_add(ptr, size) == head(); }
+
+  bool resize_last(size_t old_size, size_t new_size) noexcept {
+    if (new_size <= old_size) {
+      used -= old_size - new_size;
+      total -= old_size - new_size;
+      return true;
+    }
+    const size_t extra = new_size - old_size;
+    if (block_limit() - used < extra && !commit(used + extra)) {
+      return false;
+    }
+    bump(extra);
+    return true;
+  }
+
+  bool commit(size_t required) noexcept {
+    if (!(flags & NTF_ARENA_RESERVE) || required > root.size) {
+      return false;
+    }
+    const size_t new_committed =
+      ntf::min(commit_step * ((required + commit_step - 1) / commit_step), root.size);
+    if (mprotect(ptr_add(this, committed), new_committed - committed, PROT_READ | PROT_WRITE)) {
+      return false;
+    }
+    committed = new_committed;
+    return true;
+  }
+
+  size_t release_align() const {
+    return (flags & (NTF_ARENA_HUGEPAGE | NTF_ARENA_HUGETLB)) ? HugePageSize
+                                                              : ntf_system_page_size();
+  }
+
+  void release_above(size_t watermark) noexcept {
+    size_t keep = watermark;
+    ArenaBlock* prev = nullptr;
+    ArenaBlock* blk = &root;
+    while (blk) {
+      const size_t start = block_start(blk);
+      const size_t limit = blk == &root ? committed : blk->size;
+      if (keep >= limit - start) {
+        keep -= limit - start;
+        prev = blk;
+        blk = blk->next;
+        continue;
+      }
+      if (clear_policy == NTF_ARENA_CLEAR_TRIM) {
+        if (blk != &root && keep == 0) {
+          prev->next = nullptr;
+          unmap_chain(blk);
+          return;
+        }
+      } else {
+        void* base = ptr_add(blk, start + keep);
+        const size_t pad = align_fw_adjust(base, release_align());
+        if (start + keep + pad < limit) {
+          advise_release(ptr_add(base, pad), limit - (start + keep + pad));
+        }
+      }
+      keep = 0;
+      prev = blk;
+      blk = blk->next;
+    }
+  }
+
+  void advise_release(void* ptr, size_t size) noexcept {
+#ifdef MADV_FREE
+    // MADV_FREE needs Linux 4.5, fall back to MADV_DONTNEED
+    if (clear_policy == NTF_ARENA_CLEAR_FREE && !madvise(ptr, size, MADV_FREE)) {
+      return;
+    }
+#endif
+    int ret = madvise(ptr, size, MADV_DONTNEED);
+    NTF_UNUSED(ret);
+  }
+
+  bool next_block(size_t size, size_t align) noexcept {
+    // Blocks are page aligned, so this is enough to fit any padding
+    const size_t required = sizeof(ArenaBlock) + size + align;
+    ArenaBlock* next = block->next;
+    if (!next || next->size < required) {
+      size_t mapping_size = ntf::max(block->size * 2, next_page_size(required));
+      ntf_ArenaPageMode mode;
+      void* ptr = map_block(mapping_size, flags, mode);
+      if (!ptr) {
+        return false;
+      }
+      page_mode = ntf::min(page_mode, mode);
+      next = NTF_PNEW(ptr) ArenaBlock{block->next, mapping_size};
+      block->next = next;
+    }
+    block = next;
+    used = block_start(next);
+    return true;
+  }
 };
 
+namespace {
+
+ntf_Arena make_arena(void* ptr, size_t mapping_size, size_t committed, size_t commit_step,
+                     uint32_t flags, ntf_ArenaPageMode mode) noexcept {
+  ntf_Arena_T* arena = NTF_PNEW(ptr) ntf_Arena_T;
+  arena->root = {nullptr, mapping_size};
+  arena->block = &arena->root;
+  arena->used = sizeof(ntf_Arena_T);
+  arena->total = 0;
+  arena->peak = 0;
+  arena->retained = 0;
+  arena->min_retain = 0;
+  arena->decay_shift = 0;
+  arena->committed = committed;
+  arena->commit_step = commit_step;
+  arena->flags = flags;
+  arena->page_mode = mode;
+  arena->clear_policy = NTF_ARENA_CLEAR_KEEP;
+  NTF_ARENA_STAT(arena->stats = {});
+  return arena;
+}
+
+} // namespace
+
 int ntf_arena_init(ntf_Arena* arena, size_t capacity) noexcept {
+  return ntf_arena_init_ex(arena, capacity, NTF_ARENA_FIXED);
+}
+
+int ntf_arena_init_ex(ntf_Arena* arena, size_t capacity, uint32_t flags) noexcept {
   if (!arena) {
     return 2;
   }
-  const size_t mapping_size = ntf::max(next_page_size(capacity), MinArenaSize);
-  void* ptr = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, 0, 0);
+  // Chained arenas can start small, they will grow on demand
+  const size_t min_size = (flags & NTF_ARENA_CHAINED) ? ntf_system_page_size() : MinArenaSize;
+  size_t mapping_size = ntf::max(next_page_size(capacity + sizeof(ntf_Arena_T)), min_size);
+  flags &= ~NTF_ARENA_RESERVE;
+  ntf_ArenaPageMode mode;
+  void* ptr = map_block(mapping_size, flags, mode);
   if (!ptr) {
     return 1;
   }
 
-  *arena = NTF_PNEW(ptr) ntf_Arena_T(mapping_size, 0);
+  *arena = make_arena(ptr, mapping_size, mapping_size, 0, flags, mode);
+  return 0;
+}
+
+int ntf_arena_init_reserve(ntf_Arena* arena, size_t reserve, size_t commit_step,
+                           uint32_t flags) noexcept {
+  if (!arena) {
+    return 2;
+  }
+  size_t mapping_size = next_page_size(ntf::max(reserve, sizeof(ntf_Arena_T)));
+  commit_step = next_page_size(commit_step ? commit_step : DefaultCommitStep);
+  flags = (flags & ~NTF_ARENA_CHAINED) | NTF_ARENA_RESERVE;
+  ntf_ArenaPageMode mode;
+  void* ptr = map_block(mapping_size, flags, mode);
+  if (!ptr) {
+    return 1;
+  }
+  const size_t committed = ntf::min(commit_step, mapping_size);
+  if (mprotect(ptr, committed, PROT_READ | PROT_WRITE)) {
+    int ret = munmap(ptr, mapping_size);
+    NTF_UNUSED(ret);
+    return 1;
+  }
+
+  *arena = make_arena(ptr, mapping_size, committed, commit_step, flags, mode);
   return 0;
 }
 
@@ -63,7 +324,8 @@ void ntf_arena_destroy(ntf_Arena arena) noexcept {
   if (!arena) {
     return;
   }
-  const size_t size = arena->mapping_size;
+  unmap_chain(arena->root.next);
+  const size_t size = arena->root.size;
   int ret = munmap(arena, size);
   NTF_UNUSED(ret);
 }
@@ -72,22 +334,472 @@ void ntf_arena_clear(ntf_Arena arena) noexcept {
   if (!arena) {
     return;
   }
-  arena->used = 0;
+  if (arena->decay_shift) {
+    const size_t decayed = arena->retained - (arena->retained >> arena->decay_shift);
+    arena->retained = ntf::max(ntf::max(arena->peak, decayed), arena->min_retain);
+  } else {
+    arena->retained = arena->min_retain;
+  }
+  if (arena->clear_policy != NTF_ARENA_CLEAR_KEEP) {
+    arena->release_above(arena->retained);
+  }
+  arena->block = &arena->root;
+  arena->used = sizeof(ntf_Arena_T);
+  arena->total = 0;
+  arena->peak = 0;
+  NTF_ARENA_STAT(++arena->stats.clears);
+}
+
+void ntf_arena_set_clear_policy(ntf_Arena arena, ntf_ArenaClearPolicy policy) noexcept {
+  if (!arena) {
+    return;
+  }
+  arena->clear_policy = policy;
+}
+
+void ntf_arena_set_retain(ntf_Arena arena, size_t min_retain, uint32_t decay_shift) noexcept {
+  if (!arena) {
+    return;
+  }
+  arena->min_retain = min_retain;
+  arena->decay_shift = ntf::min(decay_shift, uint32_t(sizeof(size_t) * 8 - 1));
 }
 
 void* ntf_arena_alloc(ntf_Arena arena, size_t size, size_t align) noexcept {
   if (!arena) {
     return nullptr;
   }
-  const auto avail = arena->mapping_size - arena->used;
-  const auto pad = align_fw_adjust(arena->head(), align);
-  const auto required = size + pad;
-  if (avail < required) {
+  while (true) {
+    const auto avail = arena->block_limit() - arena->used;
+    const auto pad = align_fw_adjust(arena->head(), align);
+    const auto required = size + pad;
+    if (avail >= required) {
+      void* ptr = arena->head(pad);
+      arena->bump(required);
+      NTF_ARENA_STAT(++arena->stats.allocations);
+      NTF_ARENA_STAT(arena->stats.padding += pad);
+      return ptr;
+    }
+    if (arena->commit(arena->used + required)) {
+      continue;
+    }
+    if (!(arena->flags & NTF_ARENA_CHAINED) || !arena->next_block(size, align)) {
+      NTF_ARENA_STAT(++arena->stats.failed);
+      return nullptr;
+    }
+  }
+}
+
+void* ntf_arena_realloc(ntf_Arena arena, void* ptr, size_t old_size, size_t new_size,
+                        size_t align) noexcept {
+  if (!arena) {
     return nullptr;
   }
-  void* ptr = arena->head(pad);
-  arena->used += required;
-  return ptr;
+  if (!ptr) {
+    return ntf_arena_alloc(arena, new_size, align);
+  }
+  if (arena->is_last(ptr, old_size) && arena->resize_last(old_size, new_size)) {
+    return ptr;
+  }
+  if (new_size <= old_size) {
+    return ptr;
+  }
+  void* new_ptr = ntf_arena_alloc(arena, new_size, align);
+  if (!new_ptr) {
+    return nullptr;
+  }
+  memcpy(new_ptr, ptr, old_size);
+  return new_ptr;
+}
+
+int ntf_arena_resize(ntf_Arena arena, void* ptr, size_t old_size, size_t new_size) noexcept {
+  if (!arena || !ptr) {
+    return 2;
+  }
+  if (!arena->is_last(ptr, old_size) || !arena->resize_last(old_size, new_size)) {
+    return 1;
+  }
+  return 0;
+}
+
+void ntf_arena_free(ntf_Arena arena, void* ptr, size_t size) noexcept {
+  if (!arena || !ptr) {
+    return;
+  }
+  // Only the last allocation can be given back, anything else stays until clear or rewind
+  if (arena->is_last(ptr, size)) {
+    arena->resize_last(size, 0);
+  }
+}
+
+ntf_ArenaMark ntf_arena_mark(ntf_Arena arena) noexcept {
+  if (!arena) {
+    return {nullptr, 0, 0};
+  }
+  return {arena->block, arena->used, arena->total};
+}
+
+void ntf_arena_rewind(ntf_Arena arena, ntf_ArenaMark mark) noexcept {
+  if (!arena || !mark.block) {
+    return;
+  }
+  // Blocks after the marked one stay in the chain and get reused
+  arena->block = static_cast<ArenaBlock*>(mark.block);
+  arena->used = mark.used;
+  arena->total = mark.total;
+}
+
+ntf_ArenaPageMode ntf_arena_page_mode(ntf_Arena arena) noexcept {
+  if (!arena) {
+    return NTF_ARENA_PAGES_NORMAL;
+  }
+  return arena->page_mode;
+}
+
+int ntf_arena_stats(ntf_Arena arena, ntf_ArenaStats* stats) noexcept {
+  if (!arena || !stats) {
+    return 2;
+  }
+#ifdef NTF_ARENA_STATS
+  *stats = arena->stats;
+  stats->used = arena->total;
+  stats->retained = arena->retained;
+  return 0;
+#else
+  *stats = {};
+  stats->used = arena->total;
+  stats->retained = arena->retained;
+  return 1;
+#endif
+}
+
+size_t ntf_arena_capacity(ntf_Arena arena) noexcept {
+  if (!arena) {
+    return 0;
+  }
+  size_t capacity = 0;
+  for (const ArenaBlock* block = &arena->root; block; block = block->next) {
+    capacity += block->size;
+  }
+  return capacity;
+}
+
+namespace {
+
+constexpr size_t SharedArenaAlign = 16;
+constexpr size_t SharedArenaCacheCount = 4;
+
+uint64_t next_shared_generation() noexcept {
+  static uint64_t generation = 0;
+  return __atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+}
+
+// Thread local chunk carved from a shared arena, keyed by the arena generation so clearing or
+// destroying the arena invalidates it
+struct SharedChunk {
+  uint64_t generation;
+  size_t pos;
+  size_t end;
+};
+
+thread_local SharedChunk shared_chunks[SharedArenaCacheCount]{};
+thread_local uint32_t shared_chunk_victim = 0;
+
+} // namespace
+
+struct ntf_SharedArena_T {
+  size_t mapping_size;
+  size_t chunk_size;
+  uint64_t generation;
+  alignas(64) size_t used; // Bumped with atomic fetch-add, on its own cache line
+
+  size_t start() const { return align_size(sizeof(ntf_SharedArena_T), SharedArenaAlign); }
+
+  // Returns the offset of a block of `size` bytes, or 0 on failure
+  size_t reserve(size_t size) noexcept {
+    const size_t pos = __atomic_fetch_add(&used, size, __ATOMIC_RELAXED);
+    if (pos > mapping_size || mapping_size - pos < size) {
+      return 0;
+    }
+    return pos;
+  }
+
+  void* alloc_shared(size_t size, size_t align) noexcept {
+    // Everything is kept 16 byte aligned, so only bigger alignments need padding
+    const size_t extra = align > SharedArenaAlign ? align - SharedArenaAlign : 0;
+    const size_t pos = reserve(align_size(size + extra, SharedArenaAlign));
+    if (!pos) {
+      return nullptr;
+    }
+    void* ptr = ptr_add(this, pos);
+    return ptr_add(ptr, align_fw_adjust(ptr, align));
+  }
+
+  void* alloc_cached(size_t size, size_t align) noexcept {
+    SharedChunk* chunk = nullptr;
+    for (auto& cached : shared_chunks) {
+      if (cached.generation == generation) {
+        chunk = &cached;
+        break;
+      }
+    }
+    if (chunk) {
+      const size_t pad = align_fw_adjust(ptr_add(this, chunk->pos), align);
+      if (chunk->end - chunk->pos >= size + pad) {
+        void* ptr = ptr_add(this, chunk->pos + pad);
+        chunk->pos += size + pad;
+        return ptr;
+      }
+    } else {
+      chunk = &shared_chunks[shared_chunk_victim];
+      shared_chunk_victim = (shared_chunk_victim + 1) % SharedArenaCacheCount;
+    }
+    // Whatever is left in the old chunk is lost
+    const size_t pos = reserve(chunk_size);
+    if (!pos) {
+      chunk->generation = 0;
+      return alloc_shared(size, align);
+    }
+    *chunk = {generation, pos, pos + chunk_size};
+    const size_t pad = align_fw_adjust(ptr_add(this, pos), align);
+    chunk->pos += size + pad;
+    return ptr_add(this, pos + pad);
+  }
+};
+
+int ntf_shared_arena_init(ntf_SharedArena* arena, size_t capacity, size_t chunk_size) noexcept {
+  if (!arena) {
+    return 2;
+  }
+  // Untouched pages of a MAP_NORESERVE mapping never get backed, no need to commit manually
+  const size_t mapping_size = next_page_size(capacity + sizeof(ntf_SharedArena_T));
+  void* ptr = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE,
+                   MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+  if (ptr == MAP_FAILED) {
+    return 1;
+  }
+  ntf_SharedArena_T* new_arena = NTF_PNEW(ptr) ntf_SharedArena_T;
+  new_arena->mapping_size = mapping_size;
+  new_arena->chunk_size = align_size(chunk_size, SharedArenaAlign);
+  new_arena->generation = next_shared_generation();
+  new_arena->used = new_arena->start();
+  *arena = new_arena;
+  return 0;
+}
+
+void ntf_shared_arena_destroy(ntf_SharedArena arena) noexcept {
+  if (!arena) {
+    return;
+  }
+  int ret = munmap(arena, arena->mapping_size);
+  NTF_UNUSED(ret);
+}
+
+void ntf_shared_arena_clear(ntf_SharedArena arena) noexcept {
+  if (!arena) {
+    return;
+  }
+  __atomic_store_n(&arena->generation, next_shared_generation(), __ATOMIC_RELAXED);
+  __atomic_store_n(&arena->used, arena->start(), __ATOMIC_RELEASE);
+}
+
+void* ntf_shared_arena_alloc(ntf_SharedArena arena, size_t size, size_t align) noexcept {
+  if (!arena) {
+    return nullptr;
+  }
+  // Big allocations would waste most of a chunk, send them to the shared bump pointer
+  if (arena->chunk_size && size + align <= arena->chunk_size / 4) {
+    return arena->alloc_cached(size, align);
+  }
+  return arena->alloc_shared(size, align);
+}
+
+size_t ntf_shared_arena_used(ntf_SharedArena arena) noexcept {
+  if (!arena) {
+    return 0;
+  }
+  const size_t used = __atomic_load_n(&arena->used, __ATOMIC_RELAXED);
+  return ntf::min(used, arena->mapping_size) - arena->start();
+}
+
+namespace {
+
+constexpr size_t ScratchArenaCount = 4;
+
+struct ScratchPool {
+  ntf_Arena arenas[ScratchArenaCount]{};
+
+  ~ScratchPool() noexcept {
+    for (ntf_Arena arena : arenas) {
+      ntf_arena_destroy(arena);
+    }
+  }
+};
+
+thread_local ScratchPool scratch_pool;
+
+} // namespace
+
+ntf_Arena ntf_arena_scratch(const ntf_Arena* conflicts, size_t conflict_count) noexcept {
+  for (ntf_Arena& arena : scratch_pool.arenas) {
+    bool has_conflict = false;
+    for (size_t i = 0; arena && i < conflict_count; ++i) {
+      if (conflicts[i] == arena) {
+        has_conflict = true;
+        break;
+      }
+    }
+    if (has_conflict) {
+      continue;
+    }
+    // Created lazily, most threads only ever touch the first one or two
+    if (!arena && ntf_arena_init_ex(&arena, ScratchArenaSize, NTF_ARENA_CHAINED)) {
+      return nullptr;
+    }
+    return arena;
+  }
+  return nullptr;
+}
+
+namespace {
+
+constexpr size_t SlabSmallClassCount = 8;  // 16 byte steps up to 128
+constexpr size_t SlabClassCount = 40;      // Then four classes per power of two up to 32KiB
+constexpr size_t SlabMaxSize = 32 * 1024;
+constexpr size_t SlabMinAlign = 16;
+const size_t SlabRunSize = 16 * ntf_system_page_size(); // 64KiB when page_size == 4KiB
+
+size_t slab_class_index(size_t size) noexcept {
+  if (size <= SlabSmallClassCount * SlabMinAlign) {
+    return size ? (size - 1) / SlabMinAlign : 0;
+  }
+  const size_t log = sizeof(size_t) * 8 - 1 - (size_t)__builtin_clzl(size - 1);
+  const size_t step = size_t(1) << (log - 2);
+  const size_t sub = (size - (size_t(1) << log) + step - 1) / step;
+  return SlabSmallClassCount + (log - 7) * 4 + (sub - 1);
+}
+
+size_t slab_class_size(size_t idx) noexcept {
+  if (idx < SlabSmallClassCount) {
+    return (idx + 1) * SlabMinAlign;
+  }
+  const size_t log = 7 + (idx - SlabSmallClassCount) / 4;
+  const size_t sub = (idx - SlabSmallClassCount) % 4 + 1;
+  return (size_t(1) << log) + sub * (size_t(1) << (log - 2));
+}
+
+size_t slab_request_size(size_t size, size_t align) noexcept {
+  if (align <= SlabMinAlign) {
+    return size;
+  }
+  // Power of two classes are aligned to their size inside page aligned runs
+  size = ntf::max(size, align);
+  return size_t(1) << (sizeof(size_t) * 8 - (size_t)__builtin_clzl(size - 1));
+}
+
+struct SlabFreeNode {
+  SlabFreeNode* next;
+};
+
+struct SlabClass {
+  SlabFreeNode* free_head;
+  void* bump; // Unused tail of the last run, carved lazily so refills stay O(1)
+  size_t left;
+};
+
+} // namespace
+
+struct ntf_SlabPool_T {
+  ntf_Arena arena; // Runs for every size class are carved from here
+  size_t large_count;
+  SlabClass classes[SlabClassCount];
+
+  void* alloc_class(size_t idx) noexcept {
+    SlabClass& cls = classes[idx];
+    if (cls.free_head) {
+      SlabFreeNode* node = cls.free_head;
+      cls.free_head = node->next;
+      return node;
+    }
+    const size_t size = slab_class_size(idx);
+    if (cls.left < size) {
+      const size_t run_size = next_page_size(ntf::max(SlabRunSize, 8 * size));
+      void* run = ntf_arena_alloc(arena, run_size, ntf_system_page_size());
+      if (!run) {
+        return nullptr;
+      }
+      cls.bump = run;
+      cls.left = run_size;
+    }
+    void* ptr = cls.bump;
+    cls.bump = ptr_add(ptr, size);
+    cls.left -= size;
+    return ptr;
+  }
+
+  void free_class(size_t idx, void* ptr) noexcept {
+    SlabClass& cls = classes[idx];
+    SlabFreeNode* node = NTF_PNEW(ptr) SlabFreeNode{cls.free_head};
+    cls.free_head = node;
+  }
+};
+
+int ntf_slab_init(ntf_SlabPool* pool) noexcept {
+  if (!pool) {
+    return 2;
+  }
+  ntf_Arena arena;
+  if (ntf_arena_init_ex(&arena, SlabRunSize, NTF_ARENA_CHAINED)) {
+    return 1;
+  }
+  void* ptr = ntf_arena_alloc(arena, sizeof(ntf_SlabPool_T), alignof(ntf_SlabPool_T));
+  ntf_SlabPool_T* new_pool = NTF_PNEW(ptr) ntf_SlabPool_T;
+  new_pool->arena = arena;
+  new_pool->large_count = 0;
+  for (SlabClass& cls : new_pool->classes) {
+    cls = {nullptr, nullptr, 0};
+  }
+  *pool = new_pool;
+  return 0;
+}
+
+void ntf_slab_destroy(ntf_SlabPool pool) noexcept {
+  if (!pool) {
+    return;
+  }
+  NTF_ASSERT(pool->large_count == 0, "Destroying slab pool with live large allocations");
+  ntf_arena_destroy(pool->arena);
+}
+
+void* ntf_slab_alloc(ntf_SlabPool pool, size_t size, size_t align) noexcept {
+  if (!pool || align > ntf::min(ntf_system_page_size(), SlabMaxSize)) {
+    return nullptr;
+  }
+  // Mappings are already page aligned, so large blocks are sized without looking at the
+  // alignment and free can unmap them whatever alignment it gets passed
+  if (size > SlabMaxSize) {
+    void* ptr =
+      mmap(nullptr, next_page_size(size), PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (ptr == MAP_FAILED) {
+      return nullptr;
+    }
+    ++pool->large_count;
+    return ptr;
+  }
+  return pool->alloc_class(slab_class_index(slab_request_size(size, align)));
+}
+
+void ntf_slab_free(ntf_SlabPool pool, void* ptr, size_t size, size_t align) noexcept {
+  if (!pool || !ptr) {
+    return;
+  }
+  if (size > SlabMaxSize) {
+    int ret = munmap(ptr, next_page_size(size));
+    NTF_UNUSED(ret);
+    --pool->large_count;
+    return;
+  }
+  pool->free_class(slab_class_index(slab_request_size(size, align)), ptr);
 }
 
 // Put this here just because i don't want to make an extra file
@@ -0,0 +1,926 @@
+#include <ntf/threadpool.hpp>
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <linux/futex.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+thread_local ntf::ThreadPool* current_pool = nullptr;
+thread_local uint32_t current_worker = 0;
+thread_local uint32_t external_rng = 0x2545F491u;
+
+void cpu_relax() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield" ::: "memory");
+#endif
+}
+
+#ifdef NTF_THREADPOOL_STATS
+// Enqueue time of the last task this thread took
+thread_local uint64_t taken_enqueued = 0;
+// Time spent in tasks run from inside the current one, through try_run_one
+thread_local uint64_t nested_ns = 0;
+
+void stat_add(uint64_t& counter, uint64_t value) noexcept {
+  __atomic_fetch_add(&counter, value, __ATOMIC_RELAXED);
+}
+
+uint32_t stat_bucket(uint64_t ns) noexcept {
+  const uint32_t bucket = ns ? static_cast<uint32_t>(63 - __builtin_clzll(ns)) : 0;
+  return bucket < ntf::ThreadPoolStats::HIST_BUCKETS ? bucket
+                                                     : ntf::ThreadPoolStats::HIST_BUCKETS - 1;
+}
+#endif
+
+uint32_t xorshift32(uint32_t& state) noexcept {
+  uint32_t x = state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  state = x;
+  return x;
+}
+
+bool read_sys_u32(const char* path, uint32_t& out) noexcept {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    return false;
+  }
+  char buf[64];
+  const size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+  fclose(file);
+  if (!len) {
+    return false;
+  }
+  buf[len] = '\0';
+  // Also takes the first CPU of lists like "0-3,8-11"
+  out = static_cast<uint32_t>(strtoul(buf, nullptr, 10));
+  return true;
+}
+
+ntf::CpuInfo read_cpu_info(uint32_t cpu) noexcept {
+  ntf::CpuInfo info{cpu, cpu, 0, 0};
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", cpu);
+  if (!read_sys_u32(path, info.core)) {
+    return info;
+  }
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", cpu);
+  read_sys_u32(path, info.package);
+
+  // The cache with the highest level is the last level one
+  uint32_t best_level = 0;
+  for (uint32_t index = 0;; ++index) {
+    uint32_t level;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%u/level", cpu, index);
+    if (!read_sys_u32(path, level)) {
+      break;
+    }
+    if (level < best_level) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%u/shared_cpu_list",
+             cpu, index);
+    if (read_sys_u32(path, info.llc)) {
+      best_level = level;
+    }
+  }
+  return info;
+}
+
+} // namespace
+
+#ifdef NTF_THREADPOOL_STATS
+#define NTF_THREADPOOL_STAT(_expr) _expr
+#else
+#define NTF_THREADPOOL_STAT(_expr) NTF_NOOP
+#endif
+
+namespace ntf {
+
+u64 monotonic_ns() noexcept {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<u64>(ts.tv_sec) * 1'000'000'000u + static_cast<u64>(ts.tv_nsec);
+}
+
+std::vector<CpuInfo> cpu_topology() {
+  std::vector<CpuInfo> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set)) {
+    const u32 count = std::thread::hardware_concurrency();
+    for (u32 cpu = 0; cpu < count; ++cpu) {
+      cpus.push_back(CpuInfo{cpu, cpu, 0, 0});
+    }
+    return cpus;
+  }
+  for (u32 cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set)) {
+      cpus.push_back(read_cpu_info(cpu));
+    }
+  }
+  return cpus;
+}
+
+u32 cpu_distance(const CpuInfo& a, const CpuInfo& b) noexcept {
+  if (a.core == b.core) {
+    return 0;
+  }
+  if (a.llc == b.llc) {
+    return 1;
+  }
+  return a.package == b.package ? 2 : 3;
+}
+
+namespace impl {
+
+void futex_wait(u32* addr, u32 expected) noexcept {
+  long ret = syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+  NTF_UNUSED(ret);
+}
+
+void futex_wait(u32* addr, u32 expected, u64 timeout_ns) noexcept {
+  timespec timeout;
+  timeout.tv_sec = static_cast<time_t>(timeout_ns / 1'000'000'000u);
+  timeout.tv_nsec = static_cast<long>(timeout_ns % 1'000'000'000u);
+  long ret = syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, &timeout, nullptr, 0);
+  NTF_UNUSED(ret);
+}
+
+void futex_wake(u32* addr, u32 count) noexcept {
+  long ret = syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+  NTF_UNUSED(ret);
+}
+
+} // namespace impl
+
+ThreadPool::ThreadPool(std::size_t n_threads, u32 flags, const ThreadPoolConfig& config) :
+    _flags(flags), _config(config) {
+  if (!n_threads) {
+    n_threads = 1;
+  }
+  _worker_count = static_cast<u32>(n_threads);
+#ifdef NTF_THREADPOOL_STATS
+  _stats = new stats_t[n_threads + 1];
+#endif
+  if (_flags & POOL_WORK_STEALING) {
+    _local_tasks = new task_pool();
+    NTF_THREADPOOL_STAT(_slot_times = new u64[NTF_THREADPOOL_LOCAL_TASKS]{});
+    _workers = new worker_t[n_threads];
+    for (size_t i = 0; i < n_threads; ++i) {
+      _workers[i].rng = static_cast<u32>(i) * 0x9E3779B9u + 1u;
+    }
+  }
+  _place_workers(config);
+  // Usually points to the caller's stack, nothing reads it after placing the workers
+  _config.cpus = {};
+  _threads.reserve(n_threads);
+  for (size_t i = 0; i < n_threads; ++i) {
+    _threads.emplace_back([this, i]() { _worker_loop(static_cast<u32>(i)); });
+  }
+}
+
+ThreadPool::~ThreadPool() noexcept {
+  __atomic_store_n(&_stop, true, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&_wake_seq, 1, __ATOMIC_RELEASE);
+  impl::futex_wake(&_wake_seq, static_cast<u32>(INT32_MAX));
+
+  for (auto& thread : _threads) {
+    thread.join();
+  }
+  delete[] _workers;
+  delete _local_tasks;
+#ifdef NTF_THREADPOOL_STATS
+  delete[] _stats;
+  delete[] _slot_times;
+#endif
+}
+
+void ThreadPool::_place_workers(const ThreadPoolConfig& config) {
+  if (config.cpus.empty() && !(_flags & POOL_PIN_WORKERS)) {
+    return;
+  }
+  std::vector<CpuInfo> topology = cpu_topology();
+  std::vector<CpuInfo> placement;
+  if (!config.cpus.empty()) {
+    for (u32 id : config.cpus) {
+      auto it = std::find_if(topology.begin(), topology.end(),
+                             [id](const CpuInfo& cpu) { return cpu.id == id; });
+      placement.push_back(it != topology.end() ? *it : CpuInfo{id, id, id, 0});
+    }
+  } else {
+    std::sort(topology.begin(), topology.end(), [](const CpuInfo& a, const CpuInfo& b) {
+      if (a.package != b.package) {
+        return a.package < b.package;
+      }
+      if (a.llc != b.llc) {
+        return a.llc < b.llc;
+      }
+      return a.core != b.core ? a.core < b.core : a.id < b.id;
+    });
+    // One CPU per core first, SMT siblings after that
+    for (size_t i = 0; i < topology.size(); ++i) {
+      if (!i || topology[i].core != topology[i - 1].core) {
+        placement.push_back(topology[i]);
+      }
+    }
+    for (size_t i = 1; i < topology.size(); ++i) {
+      if (topology[i].core == topology[i - 1].core) {
+        placement.push_back(topology[i]);
+      }
+    }
+  }
+  if (placement.empty()) {
+    return;
+  }
+  for (u32 i = 0; i < _worker_count; ++i) {
+    _cpus.push_back(placement[i % placement.size()]);
+  }
+
+  if (!_workers) {
+    return;
+  }
+  for (u32 i = 0; i < _worker_count; ++i) {
+    worker_t& worker = _workers[i];
+    u32 tier_size[STEAL_TIERS]{};
+    for (u32 j = 0; j < _worker_count; ++j) {
+      if (j != i) {
+        worker.victims.push_back(j);
+        ++tier_size[cpu_distance(_cpus[i], _cpus[j])];
+      }
+    }
+    std::stable_sort(worker.victims.begin(), worker.victims.end(), [&](u32 a, u32 b) {
+      return cpu_distance(_cpus[i], _cpus[a]) < cpu_distance(_cpus[i], _cpus[b]);
+    });
+    u32 end = 0;
+    for (u32 tier = 0; tier < STEAL_TIERS; ++tier) {
+      end += tier_size[tier];
+      worker.tier_end[tier] = end;
+    }
+  }
+}
+
+void ThreadPool::enqueue(TaskPriority priority, task_type&& task) {
+  NTF_ASSERT(task, "Enqueueing empty task");
+  // Count the task before publishing it, a worker going to sleep either sees the count or we see
+  // it sleeping below
+  __atomic_add_fetch(&_pending, 1, __ATOMIC_SEQ_CST);
+  const u32 worker = priority == TaskPriority::normal ? _local_worker() : NO_WORKER;
+  task_slot slot = task_pool::null_slot;
+  if (worker != NO_WORKER) {
+    slot = _local_tasks->try_emplace(::ntf::move(task));
+  }
+  if (slot != task_pool::null_slot) {
+    _stamp_slot(slot);
+    _workers[worker].deque.push(slot);
+  } else {
+    // Also takes the overflow when the local slots run out
+    const u64 now = _enqueue_time();
+    std::unique_lock<std::mutex> lock(_task_mtx);
+    _lanes[static_cast<u32>(priority)].emplace(::ntf::move(task), now);
+    __atomic_add_fetch(&_injected, 1, __ATOMIC_RELAXED);
+    if (priority == TaskPriority::high) {
+      __atomic_add_fetch(&_urgent, 1, __ATOMIC_RELAXED);
+    }
+  }
+  _wake(1);
+}
+
+void ThreadPool::enqueue_deadline(u64 deadline_ns, task_type&& task) {
+  NTF_ASSERT(task, "Enqueueing empty task");
+  __atomic_add_fetch(&_pending, 1, __ATOMIC_SEQ_CST);
+  {
+    std::unique_lock<std::mutex> lock(_task_mtx);
+    _deadlines.push_back(deadline_entry{deadline_ns, ::ntf::move(task), _enqueue_time()});
+    std::push_heap(_deadlines.begin(), _deadlines.end(),
+                   [](const deadline_entry& a, const deadline_entry& b) {
+      return a.deadline > b.deadline;
+    });
+    __atomic_add_fetch(&_injected, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_urgent, 1, __ATOMIC_RELAXED);
+  }
+  _wake(1);
+}
+
+bool ThreadPool::on_worker() const noexcept {
+  return current_pool == this;
+}
+
+u32 ThreadPool::_local_worker() const noexcept {
+  return _workers && current_pool == this ? current_worker : NO_WORKER;
+}
+
+void ThreadPool::_wake(size_t count) {
+  // Nobody sleeps, whoever is spinning will find the tasks
+  const u32 sleeping = __atomic_load_n(&_sleeping, __ATOMIC_SEQ_CST);
+  if (!sleeping) {
+    return;
+  }
+  __atomic_add_fetch(&_wake_seq, 1, __ATOMIC_RELEASE);
+  impl::futex_wake(&_wake_seq, count < sleeping ? static_cast<u32>(count) : sleeping);
+}
+
+void ThreadPool::_worker_loop(u32 index) {
+  current_pool = this;
+  current_worker = index;
+  if (!_cpus.empty()) {
+    // Best effort, the worker just floats if the CPU is not allowed
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(_cpus[index].id, &set);
+    int ret = sched_setaffinity(0, sizeof(set), &set);
+    NTF_UNUSED(ret);
+  }
+  task_type task;
+  u64 idle_from = 0;
+  NTF_THREADPOOL_STAT(idle_from = monotonic_ns());
+  while (_wait_for_task(index, task)) {
+    idle_from = _run_task(index, task, idle_from);
+  }
+}
+
+// Returns when the task finished, only measured with NTF_THREADPOOL_STATS
+u64 ThreadPool::_run_task(u32 slot, task_type& task, u64 idle_from) {
+  __atomic_sub_fetch(&_pending, 1, __ATOMIC_RELAXED);
+#ifdef NTF_THREADPOOL_STATS
+  ThreadPoolStats& stats = _stats[slot].stats;
+  const u64 start = monotonic_ns();
+  if (idle_from) {
+    stat_add(stats.idle_ns, start - idle_from);
+  }
+  stat_add(stats.wait_hist[stat_bucket(start - taken_enqueued)], 1);
+  const u64 outer_nested = nested_ns;
+  nested_ns = 0;
+  task();
+  task.reset();
+  const u64 end = monotonic_ns();
+  // Tasks run while this one waited already counted their own time
+  const u64 self = end - start - nested_ns;
+  nested_ns = outer_nested + (end - start);
+  stat_add(stats.run_hist[stat_bucket(self)], 1);
+  stat_add(stats.busy_ns, self);
+  stat_add(stats.executed, 1);
+  return end;
+#else
+  NTF_UNUSED(slot);
+  NTF_UNUSED(idle_from);
+  task();
+  task.reset();
+  return 0;
+#endif
+}
+
+// Spins, then yields, then sleeps until there is a task. Returns false when the pool stops
+bool ThreadPool::_wait_for_task(u32 index, task_type& task) {
+  for (u32 i = 0; i < _config.spin_count; ++i) {
+    if (_find_task(index, task)) {
+      return true;
+    }
+    for (u32 j = 0; j < 8; ++j) {
+      cpu_relax();
+    }
+  }
+  for (u32 i = 0; i < _config.yield_count; ++i) {
+    if (_find_task(index, task)) {
+      return true;
+    }
+    sched_yield();
+  }
+
+  while (true) {
+    if (_find_task(index, task)) {
+      return true;
+    }
+    const u32 seq = __atomic_load_n(&_wake_seq, __ATOMIC_ACQUIRE);
+    // Either we see the pending count here or the enqueuer sees us sleeping and bumps the sequence
+    __atomic_add_fetch(&_sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&_pending, __ATOMIC_SEQ_CST)) {
+      __atomic_sub_fetch(&_sleeping, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (__atomic_load_n(&_stop, __ATOMIC_SEQ_CST)) {
+      __atomic_sub_fetch(&_sleeping, 1, __ATOMIC_RELAXED);
+      return false;
+    }
+    NTF_THREADPOOL_STAT(const u64 sleep_from = monotonic_ns());
+    impl::futex_wait(&_wake_seq, seq);
+    NTF_THREADPOOL_STAT(stat_add(_stats[index].stats.sleep_ns, monotonic_ns() - sleep_from));
+    NTF_THREADPOOL_STAT(stat_add(_stats[index].stats.sleeps, 1));
+    __atomic_sub_fetch(&_sleeping, 1, __ATOMIC_RELAXED);
+  }
+}
+
+bool ThreadPool::_find_task(u32 index, task_type& task) {
+  if (__atomic_load_n(&_urgent, __ATOMIC_RELAXED) && _pop_injected(task)) {
+    return true;
+  }
+  task_slot slot;
+  if (_workers) {
+    worker_t& worker = _workers[index];
+    if (worker.local_streak >= LANE_POLL_INTERVAL) {
+      worker.local_streak = 0;
+      if (_pop_injected(task, static_cast<u32>(TaskPriority::normal))) {
+        return true;
+      }
+    }
+    if (worker.deque.pop(slot)) {
+      ++worker.local_streak;
+      _take_slot(slot, task);
+      return true;
+    }
+    worker.local_streak = 0;
+  }
+  if (_pop_injected(task)) {
+    return true;
+  }
+  if (_workers) {
+    return _steal(index, _workers[index].rng, task);
+  }
+  return false;
+}
+
+bool ThreadPool::try_run_one() {
+  task_type task;
+  bool found;
+  if (current_pool == this) {
+    found = _find_task(current_worker, task);
+  } else {
+    found = _pop_injected(task) || (_workers && _steal(_worker_count, external_rng, task));
+  }
+  if (!found) {
+    return false;
+  }
+  _run_task(current_pool == this ? current_worker : _worker_count, task, 0);
+  return true;
+}
+
+void ThreadPool::_take_slot(task_slot slot, task_type& task) {
+  task = ::ntf::move((*_local_tasks)[slot]);
+  NTF_THREADPOOL_STAT(taken_enqueued = __atomic_load_n(&_slot_times[slot], __ATOMIC_RELAXED));
+  _local_tasks->remove(slot);
+}
+
+bool ThreadPool::_pop_injected(task_type& task, u32 max_rank) {
+  if (!__atomic_load_n(&_injected, __ATOMIC_RELAXED)) {
+    return false;
+  }
+  std::unique_lock<std::mutex> lock(_task_mtx);
+  if (!_deadlines.empty()) {
+    std::pop_heap(_deadlines.begin(), _deadlines.end(),
+                  [](const deadline_entry& a, const deadline_entry& b) {
+      return a.deadline > b.deadline;
+    });
+    task = ::ntf::move(_deadlines.back().task);
+    NTF_THREADPOOL_STAT(taken_enqueued = _deadlines.back().enqueued);
+    _deadlines.pop_back();
+    __atomic_sub_fetch(&_injected, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&_urgent, 1, __ATOMIC_RELAXED);
+    return true;
+  }
+
+  // Highest lane wins, unless a lower one waited long enough to climb up to it. The oldest task
+  // wins between lanes of the same rank
+  const u64 now = _config.aging_ns ? monotonic_ns() : 0;
+  u32 best = PRIORITY_COUNT;
+  u64 best_rank = 0;
+  u64 best_time = 0;
+  for (u32 lane = 0; lane < PRIORITY_COUNT; ++lane) {
+    if (_lanes[lane].empty()) {
+      continue;
+    }
+    const u64 enqueued = _lanes[lane].front().enqueued;
+    u64 rank = lane;
+    if (_config.aging_ns) {
+      const u64 climb = (now - enqueued) / _config.aging_ns;
+      rank = climb < lane ? lane - climb : 0;
+    }
+    if (best == PRIORITY_COUNT || rank < best_rank ||
+        (rank == best_rank && enqueued < best_time)) {
+      best = lane;
+      best_rank = rank;
+      best_time = enqueued;
+    }
+  }
+  if (best == PRIORITY_COUNT || best_rank > max_rank) {
+    return false;
+  }
+
+  task = ::ntf::move(_lanes[best].front().task);
+  NTF_THREADPOOL_STAT(taken_enqueued = _lanes[best].front().enqueued);
+  _lanes[best].pop_front();
+  __atomic_sub_fetch(&_injected, 1, __ATOMIC_RELAXED);
+  if (best == static_cast<u32>(TaskPriority::high)) {
+    __atomic_sub_fetch(&_urgent, 1, __ATOMIC_RELAXED);
+  }
+  return true;
+}
+
+bool ThreadPool::_steal(u32 thief, u32& rng, task_type& task) {
+  const u32 count = _worker_count;
+  task_slot slot;
+  if (thief < count && !_workers[thief].victims.empty()) {
+    // Closest victims first, random start inside each tier
+    const worker_t& worker = _workers[thief];
+    u32 first = 0;
+    for (u32 tier = 0; tier < STEAL_TIERS; ++tier) {
+      const u32 size = worker.tier_end[tier] - first;
+      const u32 start = size ? xorshift32(rng) % size : 0;
+      for (u32 i = 0; i < size; ++i) {
+        const u32 victim = worker.victims[first + (start + i) % size];
+        if (_workers[victim].deque.steal(slot)) {
+          _take_slot(slot, task);
+          NTF_THREADPOOL_STAT(stat_add(_stats[thief].stats.steals, 1));
+          return true;
+        }
+      }
+      first = worker.tier_end[tier];
+    }
+    NTF_THREADPOOL_STAT(stat_add(_stats[thief].stats.steal_misses, 1));
+    return false;
+  }
+
+  // Random starting victim so thieves don't all hammer the same deque
+  const u32 start = xorshift32(rng) % count;
+  for (u32 i = 0; i < count; ++i) {
+    const u32 victim = (start + i) % count;
+    if (victim != thief && _workers[victim].deque.steal(slot)) {
+      _take_slot(slot, task);
+      NTF_THREADPOOL_STAT(stat_add(_stats[thief].stats.steals, 1));
+      return true;
+    }
+  }
+  NTF_THREADPOOL_STAT(stat_add(_stats[thief].stats.steal_misses, 1));
+  return false;
+}
+
+ThreadPoolStats ThreadPool::stats() const noexcept {
+  return _read_stats(0, _worker_count + 1);
+}
+
+ThreadPoolStats ThreadPool::worker_stats(u32 index) const noexcept {
+  NTF_ASSERT(index < _worker_count, "Invalid worker index");
+  return _read_stats(index, index + 1);
+}
+
+ThreadPoolStats ThreadPool::_read_stats(u32 first, u32 last) const noexcept {
+  ThreadPoolStats out{};
+  out.backlog = __atomic_load_n(&_pending, __ATOMIC_RELAXED);
+  out.sleeping = __atomic_load_n(&_sleeping, __ATOMIC_RELAXED);
+#ifdef NTF_THREADPOOL_STATS
+  // Every counter is read on its own, the snapshot is only roughly consistent
+  auto add = [](u64& total, const u64& counter) {
+    total += __atomic_load_n(&counter, __ATOMIC_RELAXED);
+  };
+  for (u32 i = first; i < last; ++i) {
+    const ThreadPoolStats& stats = _stats[i].stats;
+    add(out.executed, stats.executed);
+    add(out.steals, stats.steals);
+    add(out.steal_misses, stats.steal_misses);
+    add(out.busy_ns, stats.busy_ns);
+    add(out.idle_ns, stats.idle_ns);
+    add(out.sleep_ns, stats.sleep_ns);
+    add(out.sleeps, stats.sleeps);
+    for (u32 bucket = 0; bucket < ThreadPoolStats::HIST_BUCKETS; ++bucket) {
+      add(out.wait_hist[bucket], stats.wait_hist[bucket]);
+      add(out.run_hist[bucket], stats.run_hist[bucket]);
+    }
+  }
+#else
+  NTF_UNUSED(first);
+  NTF_UNUSED(last);
+#endif
+  return out;
+}
+
+u64 ThreadPoolStats::percentile(const u64 (&hist)[HIST_BUCKETS], double fraction) noexcept {
+  u64 total = 0;
+  for (u64 count : hist) {
+    total += count;
+  }
+  if (!total) {
+    return 0;
+  }
+  // Rank of the sample, rounded up
+  const double rank = fraction * static_cast<double>(total);
+  u64 target = static_cast<u64>(rank);
+  target += target < rank || !target;
+  u64 seen = 0;
+  for (u32 bucket = 0; bucket < HIST_BUCKETS; ++bucket) {
+    seen += hist[bucket];
+    if (seen >= target) {
+      return (u64(1) << (bucket + 1)) - 1;
+    }
+  }
+  return (u64(1) << HIST_BUCKETS) - 1;
+}
+
+void TaskGraph::add_edge(node_id before, node_id after) {
+  NTF_ASSERT(!_running, "Modifying a running TaskGraph");
+  NTF_THROW_IF(before >= _nodes.size() || after >= _nodes.size() || before == after,
+               MsgException("Invalid TaskGraph edge"));
+  _edges.emplace_back(before, after);
+  _compiled = false;
+}
+
+void TaskGraph::_compile() {
+  // Lay out the successor lists contiguously, counting sort by source node
+  for (auto& node : _nodes) {
+    node.deps = 0;
+    node.succ_count = 0;
+  }
+  for (const auto& [before, after] : _edges) {
+    ++_nodes[before].succ_count;
+    ++_nodes[after].deps;
+  }
+  u32 offset = 0;
+  for (auto& node : _nodes) {
+    node.succ_first = offset;
+    offset += node.succ_count;
+    node.succ_count = 0;
+  }
+  _succs.resize(_edges.size());
+  for (const auto& [before, after] : _edges) {
+    auto& node = _nodes[before];
+    _succs[node.succ_first + node.succ_count++] = after;
+  }
+
+  _roots.clear();
+  for (node_id i = 0; i < _nodes.size(); ++i) {
+    if (!_nodes[i].deps) {
+      _roots.push_back(i);
+    }
+  }
+
+  // Kahn's algorithm, every node has to be reachable from a root or there is a cycle
+  std::vector<node_id> queue{_roots};
+  for (auto& node : _nodes) {
+    node.pending = node.deps;
+  }
+  for (size_t i = 0; i < queue.size(); ++i) {
+    const auto& node = _nodes[queue[i]];
+    for (u32 j = 0; j < node.succ_count; ++j) {
+      const node_id succ = _succs[node.succ_first + j];
+      if (!--_nodes[succ].pending) {
+        queue.push_back(succ);
+      }
+    }
+  }
+  NTF_THROW_IF(queue.size() != _nodes.size(), MsgException("TaskGraph has a cycle"));
+  _compiled = true;
+}
+
+void TaskGraph::run(ThreadPool& pool) {
+  NTF_ASSERT(!_running, "TaskGraph is already running");
+  if (!_compiled) {
+    _compile();
+  }
+  if (_nodes.empty()) {
+    return;
+  }
+  for (auto& node : _nodes) {
+    node.pending = node.deps;
+  }
+  _pool = &pool;
+  _running = true;
+  _remaining = static_cast<u32>(_nodes.size());
+
+  // The caller takes the first root itself
+  for (size_t i = 1; i < _roots.size(); ++i) {
+    const node_id root = _roots[i];
+    pool.enqueue([this, root]() { _run_node(root); });
+  }
+  _run_node(_roots[0]);
+  impl::help_while_pending(pool, _remaining);
+  _running = false;
+}
+
+void TaskGraph::_run_node(node_id id) {
+  while (true) {
+    node_t& node = _nodes[id];
+    node.func();
+
+    // Keep one ready successor for this thread, hand the rest to the pool
+    node_id next = static_cast<node_id>(-1);
+    for (u32 i = 0; i < node.succ_count; ++i) {
+      const node_id succ = _succs[node.succ_first + i];
+      if (__atomic_sub_fetch(&_nodes[succ].pending, 1, __ATOMIC_ACQ_REL)) {
+        continue;
+      }
+      if (next == static_cast<node_id>(-1)) {
+        next = succ;
+      } else {
+        _pool->enqueue([this, succ]() { _run_node(succ); });
+      }
+    }
+    impl::release_pending(_remaining);
+    if (next == static_cast<node_id>(-1)) {
+      return;
+    }
+    id = next;
+  }
+}
+
+TimerWheel::TimerWheel(ThreadPool& pool, u64 tick_ns, TaskPriority priority) :
+    _pool(pool), _tick_ns(tick_ns ? tick_ns : 1), _start(monotonic_ns()), _priority(priority) {
+  for (auto& slot : _slots) {
+    slot = null_timer;
+  }
+  _thread = std::thread([this]() { _timer_loop(); });
+}
+
+TimerWheel::~TimerWheel() noexcept {
+  {
+    std::unique_lock<std::mutex> lock(_mtx);
+    _stop = true;
+    __atomic_add_fetch(&_wake_seq, 1, __ATOMIC_RELEASE);
+  }
+  impl::futex_wake(&_wake_seq, 1);
+  _thread.join();
+}
+
+TimerWheel::timer_id TimerWheel::schedule_at(u64 deadline_ns, task_type&& task) {
+  NTF_ASSERT(task, "Scheduling empty task");
+  // Rounded up, timers never fire early
+  const u64 elapsed = deadline_ns > _start ? deadline_ns - _start : 0;
+  const u64 tick = elapsed / _tick_ns + (elapsed % _tick_ns != 0);
+  timer_id timer;
+  bool wake;
+  {
+    std::unique_lock<std::mutex> lock(_mtx);
+    const u64 expiry = tick > _now ? tick : _now + 1;
+    timer = _timers.emplace(entry_t{::ntf::move(task), expiry, null_timer, null_timer, 0});
+    _link(timer, _timers[timer]);
+    wake = expiry < _wake_tick;
+    if (wake) {
+      _wake_tick = expiry;
+      __atomic_add_fetch(&_wake_seq, 1, __ATOMIC_RELEASE);
+    }
+  }
+  if (wake) {
+    impl::futex_wake(&_wake_seq, 1);
+  }
+  return timer;
+}
+
+bool TimerWheel::cancel(timer_id timer) {
+  task_type task; // Destroyed after unlocking
+  std::unique_lock<std::mutex> lock(_mtx);
+  entry_t* entry = _timers.at_opt(timer);
+  if (!entry) {
+    return false;
+  }
+  _unlink(*entry);
+  task = ::ntf::move(entry->task);
+  _timers.remove(timer);
+  return true;
+}
+
+size_t TimerWheel::size() const {
+  std::unique_lock<std::mutex> lock(_mtx);
+  return _timers.size();
+}
+
+void TimerWheel::_link(timer_id timer, entry_t& entry) {
+  // Timers due right now go to the current level 0 slot, which expires after cascading
+  const u64 diff = entry.expiry ^ _now;
+  const u32 level = diff ? static_cast<u32>(63 - __builtin_clzll(diff)) / LEVEL_BITS : 0;
+  if (level < LEVELS) {
+    const u32 digit = (entry.expiry >> (level * LEVEL_BITS)) & (LEVEL_SLOTS - 1);
+    entry.slot = level * LEVEL_SLOTS + digit;
+    _occupied[level] |= u64(1) << digit;
+  } else {
+    entry.slot = OVERFLOW_SLOT;
+  }
+  timer_id& head = _slots[entry.slot];
+  entry.prev = null_timer;
+  entry.next = head;
+  if (head != null_timer) {
+    _timers[head].prev = timer;
+  }
+  head = timer;
+}
+
+void TimerWheel::_unlink(entry_t& entry) {
+  if (entry.next != null_timer) {
+    _timers[entry.next].prev = entry.prev;
+  }
+  if (entry.prev != null_timer) {
+    _timers[entry.prev].next = entry.next;
+    return;
+  }
+  _slots[entry.slot] = entry.next;
+  if (entry.next == null_timer && entry.slot != OVERFLOW_SLOT) {
+    _occupied[entry.slot / LEVEL_SLOTS] &= ~(u64(1) << (entry.slot % LEVEL_SLOTS));
+  }
+}
+
+void TimerWheel::_cascade(u32 slot) {
+  timer_id timer = _slots[slot];
+  _slots[slot] = null_timer;
+  if (slot != OVERFLOW_SLOT) {
+    _occupied[slot / LEVEL_SLOTS] &= ~(u64(1) << (slot % LEVEL_SLOTS));
+  }
+  while (timer != null_timer) {
+    entry_t& entry = _timers[timer];
+    const timer_id next = entry.next;
+    _link(timer, entry);
+    timer = next;
+  }
+}
+
+void TimerWheel::_expire(u32 slot) {
+  timer_id timer = _slots[slot];
+  _slots[slot] = null_timer;
+  _occupied[0] &= ~(u64(1) << slot);
+  while (timer != null_timer) {
+    entry_t& entry = _timers[timer];
+    const timer_id next = entry.next;
+    _expired.push_back(::ntf::move(entry.task));
+    _timers.remove(timer);
+    timer = next;
+  }
+}
+
+// Jumps from event to event instead of going through every tick
+void TimerWheel::_advance(u64 tick) {
+  constexpr u32 top_shift = LEVELS * LEVEL_BITS;
+  while (_now < tick) {
+    const u64 next = _next_event();
+    if (next > tick) {
+      _now = tick;
+      return;
+    }
+    _now = next;
+    if (!(_now & ((u64(1) << top_shift) - 1))) {
+      _cascade(OVERFLOW_SLOT);
+    }
+    for (u32 level = LEVELS - 1; level > 0; --level) {
+      const u32 shift = level * LEVEL_BITS;
+      if (!(_now & ((u64(1) << shift) - 1))) {
+        _cascade(level * LEVEL_SLOTS + ((_now >> shift) & (LEVEL_SLOTS - 1)));
+      }
+    }
+    _expire(_now & (LEVEL_SLOTS - 1));
+  }
+}
+
+// Lower levels always fire first, their slots are all inside the current turn of the level above
+u64 TimerWheel::_next_event() const noexcept {
+  if (_timers.empty()) {
+    return NO_TICK;
+  }
+  for (u32 level = 0; level < LEVELS; ++level) {
+    const u32 shift = level * LEVEL_BITS;
+    const u32 digit = (_now >> shift) & (LEVEL_SLOTS - 1);
+    const u64 later = digit + 1 < LEVEL_SLOTS ? _occupied[level] & (~u64(0) << (digit + 1)) : 0;
+    if (later) {
+      const u64 turn = _now >> (shift + LEVEL_BITS) << (shift + LEVEL_BITS);
+      return turn | (static_cast<u64>(__builtin_ctzll(later)) << shift);
+    }
+  }
+  constexpr u32 top_shift = LEVELS * LEVEL_BITS;
+  return ((_now >> top_shift) + 1) << top_shift;
+}
+
+void TimerWheel::_timer_loop() {
+  std::unique_lock<std::mutex> lock(_mtx);
+  while (!_stop) {
+    _advance((monotonic_ns() - _start) / _tick_ns);
+    if (!_expired.empty()) {
+      // Only this thread touches the expired tasks
+      lock.unlock();
+      _pool.enqueue_bulk(Span<task_type>{_expired.data(), _expired.size()}, _priority);
+      _expired.clear();
+      lock.lock();
+      continue;
+    }
+
+    const u64 next = _next_event();
+    _wake_tick = next;
+    const u32 seq = __atomic_load_n(&_wake_seq, __ATOMIC_RELAXED);
+    lock.unlock();
+    if (next == NO_TICK || next > (NO_TICK - _start) / _tick_ns) {
+      impl::futex_wait(&_wake_seq, seq);
+    } else {
+      const u64 now = monotonic_ns();
+      const u64 when = _start + next * _tick_ns;
+      if (when > now) {
+        impl::futex_wait(&_wake_seq, seq, when - now);
+      }
+    }
+    lock.lock();
+  }
+}
+
+} // namespace ntf
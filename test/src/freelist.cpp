@@ -0,0 +1,158 @@
+#include <catch2/catch_test_macros.hpp>
+#include <ntf/freelist.hpp>
+#include <ntf/unique.hpp>
+
+#include <thread>
+
+using namespace ntf::numdefs;
+
+TEST_CASE("ConcurrentFixedFreelist single thread", "[ConcurrentFixedFreelist]") {
+  ntf::ConcurrentFixedFreelist<int, 8, 2, 1> list;
+  ntf::FreelistSlot slots[8];
+  for (int i = 0; i < 8; ++i) {
+    slots[i] = list.emplace(i);
+  }
+  REQUIRE(list.size() == 8);
+
+  list.remove(slots[3]);
+  list.remove(slots[3]);
+  REQUIRE(list.size() == 7);
+  REQUIRE_FALSE(list.has_element(slots[3]));
+  REQUIRE(list.at_opt(slots[3]) == nullptr);
+
+  const auto slot = list.insert(42);
+  REQUIRE(slot == slots[3]);
+  REQUIRE(list[slot] == 42);
+}
+
+TEST_CASE("ConcurrentFixedFreelist multiple threads", "[ConcurrentFixedFreelist]") {
+  constexpr size_t thread_count = 4;
+  constexpr size_t iterations = 20000;
+  ntf::ConcurrentFixedFreelist<u64, 256> list;
+
+  // Catch2 assertions are not thread safe, count mismatches instead
+  size_t mismatches = 0;
+  std::thread threads[thread_count];
+  for (size_t i = 0; i < thread_count; ++i) {
+    threads[i] = std::thread([&list, &mismatches, i]() {
+      ntf::FreelistSlot held[16];
+      for (size_t j = 0; j < iterations; ++j) {
+        const size_t k = j % 16;
+        if (j >= 16) {
+          if (list[held[k]] != i * iterations + j - 16) {
+            __atomic_fetch_add(&mismatches, 1, __ATOMIC_RELAXED);
+          }
+          list.remove(held[k]);
+        }
+        held[k] = list.emplace(i * iterations + j);
+      }
+      for (auto slot : held) {
+        list.remove(slot);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  REQUIRE(mismatches == 0);
+  REQUIRE(list.empty());
+}
+
+TEST_CASE("SlotMap handles", "[SlotMap]") {
+  ntf::SlotMap<int> map;
+  ntf::SlotHandle handles[32];
+  for (int i = 0; i < 32; ++i) {
+    handles[i] = map.emplace(i);
+  }
+  REQUIRE(map.size() == 32);
+  REQUIRE(map[handles[20]] == 20);
+
+  SECTION("Stale handles are detected") {
+    REQUIRE(map.remove(handles[5]));
+    REQUIRE_FALSE(map.remove(handles[5]));
+    const auto reused = map.insert(100);
+    REQUIRE(reused.index == handles[5].index);
+    REQUIRE_FALSE(map.contains(handles[5]));
+    REQUIRE(map.at_opt(handles[5]) == nullptr);
+    REQUIRE(map[reused] == 100);
+  }
+  SECTION("Values stay dense") {
+    for (int i = 0; i < 32; i += 2) {
+      map.remove(handles[i]);
+    }
+    REQUIRE(map.size() == 16);
+    int sum = 0;
+    for (int val : map) {
+      REQUIRE(val % 2 == 1);
+      sum += val;
+    }
+    REQUIRE(sum == 256);
+    map.for_each([&](int& val, ntf::SlotHandle handle) { REQUIRE(map[handle] == val); });
+  }
+  SECTION("Clear invalidates every handle") {
+    map.clear();
+    REQUIRE(map.empty());
+    REQUIRE_FALSE(map.contains(handles[0]));
+    REQUIRE(map.at_opt(map.insert(7)) != nullptr);
+  }
+}
+
+TEST_CASE("FixedFreelist sparse iteration", "[FixedFreelist]") {
+  auto list = ntf::make_unique<ntf::FixedFreelist<u32, 1000>>();
+  ntf::FreelistSlot slots[1000];
+  for (u32 i = 0; i < 1000; ++i) {
+    slots[i] = list->emplace(i);
+  }
+  for (u32 i = 0; i < 1000; ++i) {
+    if (i % 97 != 0) {
+      list->remove(slots[i]);
+    }
+  }
+  REQUIRE(list->size() == 11);
+  REQUIRE(list->has_element(slots[97]));
+  REQUIRE_FALSE(list->has_element(slots[98]));
+
+  u32 visited = 0;
+  list->for_each([&](u32& val, ntf::FreelistSlot slot) {
+    REQUIRE(val % 97 == 0);
+    REQUIRE(slot == val);
+    ++visited;
+  });
+  REQUIRE(visited == 11);
+
+  list->clear();
+  REQUIRE(list->empty());
+  REQUIRE_FALSE(list->has_element(slots[97]));
+  REQUIRE(list->emplace(5u) == 0);
+}
+
+TEST_CASE("Freelist growth", "[Freelist]") {
+  SECTION("Addresses stay stable while growing") {
+    ntf::Freelist<u64, ntf::DefaultAlloc<u64>, 64> list;
+    const auto first = list.emplace(1u);
+    const u64* first_ptr = &list[first];
+    for (u64 i = 0; i < 1000; ++i) {
+      list.emplace(i);
+    }
+    REQUIRE(list.size() == 1001);
+    REQUIRE(list.capacity() >= 1001);
+    REQUIRE(&list[first] == first_ptr);
+    REQUIRE(*first_ptr == 1);
+
+    list.remove(first);
+    REQUIRE(list.insert(5u) == first);
+    list.clear();
+    REQUIRE(list.empty());
+    REQUIRE(list.capacity() >= 1001);
+  }
+  SECTION("Arena backed") {
+    ntf::Arena arena{4096, NTF_ARENA_CHAINED};
+    ntf::Freelist<u32, ntf::ArenaAlloc<u32>> list{ntf::ArenaAlloc<u32>{arena}};
+    for (u32 i = 0; i < 600; ++i) {
+      list.emplace(i);
+    }
+    u32 sum = 0;
+    list.for_each([&](u32& val) { sum += val; });
+    REQUIRE(sum == 599 * 600 / 2);
+  }
+}
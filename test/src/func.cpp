@@ -69,3 +69,40 @@ TEST_CASE("TrivFn assignment", "[TrivFn]") {
     REQUIRE(f(8) == 8);
   }
 }
+
+TEST_CASE("InplaceFn move only callables", "[InplaceFn]") {
+  int dtor_count = 0;
+  struct Counted {
+    int* count;
+    int val;
+
+    Counted(int* count_, int val_) : count(count_), val(val_) {}
+
+    Counted(Counted&& other) noexcept : count(other.count), val(other.val) {
+      other.count = nullptr;
+    }
+
+    ~Counted() noexcept {
+      if (count) {
+        ++*count;
+      }
+    }
+
+    int operator()(int a) { return val * a; }
+  };
+
+  {
+    ntf::InplaceFn<int(int), sizeof(Counted)> f{ntf::in_place_type<Counted>, &dtor_count, 3};
+    REQUIRE(f(2) == 6);
+
+    ntf::InplaceFn<int(int), sizeof(Counted)> g{ntf::move(f)};
+    REQUIRE_FALSE(f);
+    REQUIRE(g(3) == 9);
+    REQUIRE(dtor_count == 0);
+
+    g = &fptr;
+    REQUIRE(dtor_count == 1);
+    REQUIRE(g(4) == 8);
+  }
+  REQUIRE(dtor_count == 1);
+}
@@ -0,0 +1,309 @@
+#include <catch2/catch_test_macros.hpp>
+#include <ntf/memory.hpp>
+
+#include <thread>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace ntf::numdefs;
+
+TEST_CASE("Arena allocation", "[Arena]") {
+  ntf::Arena arena{1024};
+
+  SECTION("Allocations are aligned") {
+    void* a = arena.allocate(3, 1);
+    void* b = arena.allocate(sizeof(u64), alignof(u64));
+    REQUIRE(a != nullptr);
+    REQUIRE(reinterpret_cast<uintptr_t>(b) % alignof(u64) == 0);
+  }
+  SECTION("Fixed arenas fail when full") {
+    const size_t cap = arena.capacity();
+    REQUIRE_THROWS_AS(arena.allocate(cap, 1), ntf::BadAlloc);
+    REQUIRE(arena.capacity() == cap);
+  }
+}
+
+TEST_CASE("Chained Arena growth", "[Arena]") {
+  const size_t page_size = ntf_system_page_size();
+  ntf::Arena arena{page_size, NTF_ARENA_CHAINED};
+  const size_t initial_cap = arena.capacity();
+
+  SECTION("Grows past the first block") {
+    u8* a = static_cast<u8*>(arena.allocate(page_size / 2, 1));
+    u8* b = static_cast<u8*>(arena.allocate(4 * page_size, 16));
+    a[0] = 1;
+    b[4 * page_size - 1] = 2;
+    REQUIRE(arena.capacity() > initial_cap);
+    REQUIRE(reinterpret_cast<uintptr_t>(b) % 16 == 0);
+  }
+  SECTION("Clear keeps or trims the chain") {
+    arena.allocate(8 * page_size, 8);
+    const size_t grown_cap = arena.capacity();
+    arena.clear();
+    REQUIRE(arena.capacity() == grown_cap);
+    arena.allocate(8 * page_size, 8);
+    REQUIRE(arena.capacity() == grown_cap);
+
+    arena.set_clear_policy(NTF_ARENA_CLEAR_TRIM);
+    arena.clear();
+    REQUIRE(arena.capacity() == initial_cap);
+  }
+}
+
+TEST_CASE("Reserved Arena commit", "[Arena]") {
+  const size_t page_size = ntf_system_page_size();
+  const size_t reserve = size_t(1) << 32;
+  ntf::Arena arena{ntf::arena_reserve, reserve, 4 * page_size};
+  REQUIRE(arena.capacity() == reserve);
+
+  u8* first = static_cast<u8*>(arena.allocate(page_size, 8));
+  u8* big = static_cast<u8*>(arena.allocate(16 * page_size, 8));
+  first[page_size - 1] = 1;
+  big[16 * page_size - 1] = 2;
+  REQUIRE(big > first);
+  REQUIRE_THROWS_AS(arena.allocate(reserve, 8), ntf::BadAlloc);
+}
+
+TEST_CASE("ArenaScope rewind", "[Arena]") {
+  const size_t page_size = ntf_system_page_size();
+  ntf::Arena arena{page_size, NTF_ARENA_CHAINED};
+  void* outer = arena.allocate(64, 8);
+
+  void* inner_first;
+  {
+    ntf::ArenaScope scope{arena};
+    inner_first = arena.allocate(64, 8);
+    {
+      ntf::ArenaScope nested{arena};
+      arena.allocate(4 * page_size, 8); // Forces a new block
+    }
+    REQUIRE(arena.allocate(64, 8) != inner_first);
+  }
+  REQUIRE(arena.allocate(64, 8) == inner_first);
+  REQUIRE(outer != inner_first);
+}
+
+TEST_CASE("ScratchArena borrowing", "[Arena]") {
+  ntf::ScratchArena first;
+  void* ptr = first.allocate(128, 16);
+  REQUIRE(ptr != nullptr);
+
+  SECTION("Skips conflicting arenas") {
+    ntf::ScratchArena second{first.arena()};
+    REQUIRE(second.arena() != first.arena());
+    ntf::ScratchArena third{first.arena(), second.arena()};
+    REQUIRE(third.arena() != first.arena());
+    REQUIRE(third.arena() != second.arena());
+  }
+  SECTION("Takes arena objects as conflicts") {
+    ntf::Arena arena{1024};
+    ntf::ScratchArena inner{first};
+    REQUIRE(inner.arena() != first.arena());
+    ntf::ScratchArena mixed{arena, first, inner};
+    REQUIRE(mixed.arena() != first.arena());
+    REQUIRE(mixed.arena() != inner.arena());
+    REQUIRE(mixed.arena() != arena.arena());
+  }
+  SECTION("Reuses the same arena without conflicts") {
+    void* nested_ptr;
+    {
+      ntf::ScratchArena nested;
+      REQUIRE(nested.arena() == first.arena());
+      nested_ptr = nested.allocate(128, 16);
+    }
+    REQUIRE(first.allocate(128, 16) == nested_ptr);
+  }
+}
+
+TEST_CASE("Huge page Arena flags", "[Arena]") {
+  const size_t huge_page = 2 * 1024 * 1024;
+
+  SECTION("Transparent huge pages align blocks") {
+    ntf::Arena arena{huge_page, NTF_ARENA_HUGEPAGE | NTF_ARENA_CHAINED};
+    REQUIRE(reinterpret_cast<uintptr_t>(arena.arena()) % huge_page == 0);
+    REQUIRE(arena.page_mode() != NTF_ARENA_PAGES_HUGETLB);
+    u8* ptr = static_cast<u8*>(arena.allocate(2 * huge_page, 64));
+    ptr[2 * huge_page - 1] = 1;
+  }
+  SECTION("HugeTLB falls back without failing") {
+    ntf::Arena arena{huge_page, NTF_ARENA_HUGETLB};
+    u8* ptr = static_cast<u8*>(arena.allocate(huge_page / 2, 64));
+    ptr[huge_page / 2 - 1] = 1;
+    if (arena.page_mode() == NTF_ARENA_PAGES_HUGETLB) {
+      REQUIRE(arena.capacity() % huge_page == 0);
+    }
+  }
+  SECTION("Reserved arenas never use HugeTLB") {
+    ntf::Arena arena{ntf::arena_reserve, 16 * huge_page, huge_page, NTF_ARENA_HUGETLB};
+    REQUIRE(arena.page_mode() == NTF_ARENA_PAGES_NORMAL);
+  }
+}
+
+TEST_CASE("Arena stats", "[Arena]") {
+  ntf::Arena arena{1024};
+  arena.allocate(1, 1);
+  arena.allocate(8, 8);
+  REQUIRE(arena.stats().used == 16);
+
+  const auto mark = arena.mark();
+  arena.allocate(64, 8);
+  arena.rewind(mark);
+  REQUIRE(arena.stats().used == 16);
+
+#ifdef NTF_ARENA_STATS
+  REQUIRE_THROWS_AS(arena.allocate(arena.capacity(), 1), ntf::BadAlloc);
+  arena.clear();
+  const auto stats = arena.stats();
+  REQUIRE(stats.used == 0);
+  REQUIRE(stats.peak == 80);
+  REQUIRE(stats.allocations == 3);
+  REQUIRE(stats.padding == 7);
+  REQUIRE(stats.clears == 1);
+  REQUIRE(stats.failed == 1);
+#endif
+}
+
+TEST_CASE("Arena clear policies", "[Arena]") {
+  const size_t page_size = ntf_system_page_size();
+
+  SECTION("DONTNEED releases pages above the watermark") {
+    ntf::Arena arena{8 * page_size};
+    arena.set_clear_policy(NTF_ARENA_CLEAR_DONTNEED);
+    arena.set_retain(2 * page_size);
+
+    u8* ptr = static_cast<u8*>(arena.allocate(6 * page_size, page_size));
+    ptr[page_size] = 0xAA;
+    ptr[5 * page_size] = 0xAA;
+    arena.clear();
+
+    REQUIRE(arena.allocate(6 * page_size, page_size) == ptr);
+    REQUIRE(ptr[page_size] == 0xAA);
+    REQUIRE(ptr[5 * page_size] == 0x00);
+  }
+  SECTION("High water mark decays across clears") {
+    ntf::Arena arena{8 * page_size};
+    arena.set_clear_policy(NTF_ARENA_CLEAR_FREE);
+    arena.set_retain(0, 1);
+
+    arena.allocate(4 * page_size, 1);
+    arena.clear();
+    REQUIRE(arena.stats().retained == 4 * page_size);
+
+    arena.allocate(page_size, 1);
+    arena.clear();
+    REQUIRE(arena.stats().retained == 2 * page_size);
+
+    arena.clear();
+    REQUIRE(arena.stats().retained == page_size);
+  }
+}
+
+TEST_CASE("Arena in place resize", "[Arena]") {
+  ntf::Arena arena{1024};
+  ntf::ArenaAlloc<int> alloc{arena};
+
+  SECTION("Last allocation grows and shrinks in place") {
+    int* first = alloc.allocate(4);
+    int* last = alloc.allocate(4);
+    REQUIRE(alloc.try_extend(last, 4, 64));
+    REQUIRE(alloc.try_extend(last, 64, 2));
+    REQUIRE_FALSE(alloc.try_extend(first, 4, 8));
+    REQUIRE(alloc.allocate(1) == last + 2);
+  }
+  SECTION("Freeing the last allocation reclaims it") {
+    int* ptr = alloc.allocate(16);
+    alloc.deallocate(ptr, 16);
+    REQUIRE(alloc.allocate(16) == ptr);
+  }
+  SECTION("Reallocate copies when it can't grow in place") {
+    int* ptr = static_cast<int*>(arena.allocate(2 * sizeof(int), alignof(int)));
+    ptr[0] = 1;
+    ptr[1] = 2;
+    arena.allocate(1, 1);
+    int* moved =
+      static_cast<int*>(arena.reallocate(ptr, 2 * sizeof(int), 8 * sizeof(int), alignof(int)));
+    REQUIRE(moved != ptr);
+    REQUIRE(moved[0] == 1);
+    REQUIRE(moved[1] == 2);
+    REQUIRE(arena.reallocate(moved, 8 * sizeof(int), 32 * sizeof(int), alignof(int)) == moved);
+  }
+}
+
+TEST_CASE("SharedArena concurrent allocation", "[SharedArena]") {
+  constexpr size_t thread_count = 4;
+  constexpr size_t alloc_count = 1024;
+  ntf::SharedArena arena{16 * 1024 * 1024, 4096};
+
+  u64* ptrs[thread_count][alloc_count];
+  std::thread threads[thread_count];
+  for (size_t i = 0; i < thread_count; ++i) {
+    threads[i] = std::thread([&, i]() {
+      for (size_t j = 0; j < alloc_count; ++j) {
+        u64* ptr = static_cast<u64*>(arena.allocate(sizeof(u64) * (1 + j % 3), alignof(u64)));
+        *ptr = i * alloc_count + j;
+        ptrs[i][j] = ptr;
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (size_t i = 0; i < thread_count; ++i) {
+    for (size_t j = 0; j < alloc_count; ++j) {
+      REQUIRE(reinterpret_cast<uintptr_t>(ptrs[i][j]) % alignof(u64) == 0);
+      REQUIRE(*ptrs[i][j] == i * alloc_count + j);
+    }
+  }
+
+  arena.clear();
+  REQUIRE(arena.used() == 0);
+  void* big = arena.allocate(8192, 64);
+  REQUIRE(reinterpret_cast<uintptr_t>(big) % 64 == 0);
+  REQUIRE(arena.used() >= 8192);
+}
+
+TEST_CASE("SlabPool size classes", "[SlabPool]") {
+  ntf::SlabPool pool;
+
+  SECTION("Freed blocks get reused by the same class") {
+    void* a = pool.allocate(24, 8);
+    void* b = pool.allocate(32, 8);
+    void* c = pool.allocate(200, 8);
+    REQUIRE(static_cast<u8*>(b) - static_cast<u8*>(a) == 32);
+    pool.deallocate(a, 24);
+    REQUIRE(pool.allocate(17, 8) == a);
+    REQUIRE(pool.allocate(200, 8) != c);
+  }
+  SECTION("Over aligned and large blocks") {
+    REQUIRE_THROWS_AS(pool.allocate(40, 256), ntf::BadAlloc);
+    void* aligned = pool.allocate_aligned(40, 256);
+    REQUIRE(reinterpret_cast<uintptr_t>(aligned) % 256 == 0);
+    pool.deallocate_aligned(aligned, 40, 256);
+    REQUIRE(pool.allocate_aligned(200, 256) == aligned);
+
+    u8* large = static_cast<u8*>(pool.allocate(1024 * 1024, 16));
+    large[1024 * 1024 - 1] = 1;
+    pool.deallocate(large, 1024 * 1024);
+  }
+  SECTION("Large blocks are unmapped whole without their alignment") {
+    // Total mapped pages, read without allocating so nothing else gets mapped in between
+    const auto mapped_pages = [] {
+      char buf[64] = {};
+      int fd = open("/proc/self/statm", O_RDONLY);
+      ssize_t ret = read(fd, buf, sizeof(buf) - 1);
+      close(fd);
+      REQUIRE(ret > 0);
+      return strtoul(buf, nullptr, 10);
+    };
+    const size_t size = 40 * 1024;
+    const auto before = mapped_pages();
+    u8* large = static_cast<u8*>(pool.allocate_aligned(size, 4096));
+    REQUIRE(reinterpret_cast<uintptr_t>(large) % 4096 == 0);
+    large[size - 1] = 1;
+    pool.deallocate(large, size);
+    REQUIRE(mapped_pages() == before);
+  }
+}
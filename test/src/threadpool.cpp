@@ -0,0 +1,667 @@
+#include <catch2/catch_test_macros.hpp>
+#include <ntf/threadpool.hpp>
+#include <ntf/unique.hpp>
+
+#include <chrono>
+#include <thread>
+
+#include <sched.h>
+#include <string.h>
+
+using namespace ntf::numdefs;
+
+namespace {
+
+void spawn_tree(ntf::ThreadPool& pool, u32 depth, u32& counter) {
+  __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+  if (!depth) {
+    return;
+  }
+  for (u32 i = 0; i < 2; ++i) {
+    pool.enqueue([&pool, depth, &counter]() { spawn_tree(pool, depth - 1, counter); });
+  }
+}
+
+} // namespace
+
+TEST_CASE("ThreadPool runs every task", "[ThreadPool]") {
+  constexpr u32 task_count = 10000;
+  u32 counter = 0;
+
+  SECTION("Shared queue") {
+    {
+      ntf::ThreadPool pool{4};
+      for (u32 i = 0; i < task_count; ++i) {
+        pool.enqueue([&counter]() { __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED); });
+      }
+    }
+    REQUIRE(counter == task_count);
+  }
+  SECTION("Work stealing") {
+    {
+      ntf::ThreadPool pool{4, ntf::POOL_WORK_STEALING};
+      for (u32 i = 0; i < task_count; ++i) {
+        pool.enqueue([&counter]() { __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED); });
+      }
+    }
+    REQUIRE(counter == task_count);
+  }
+  SECTION("Bursts with workers going straight to sleep") {
+    {
+      ntf::ThreadPool pool{4, ntf::POOL_WORK_STEALING, {.spin_count = 0, .yield_count = 0}};
+      for (u32 burst = 0; burst < 100; ++burst) {
+        auto done = pool.enqueue(ntf::with_future, [&counter]() {
+          __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+        });
+        done.wait();
+      }
+    }
+    REQUIRE(counter == 100);
+  }
+  SECTION("Tasks spawned from workers") {
+    {
+      ntf::ThreadPool pool{4, ntf::POOL_WORK_STEALING};
+      pool.enqueue([&pool, &counter]() { spawn_tree(pool, 12, counter); });
+    }
+    REQUIRE(counter == (1u << 13) - 1);
+  }
+}
+
+TEST_CASE("WorkDeque ordering", "[ThreadPool]") {
+  ntf::impl::WorkDeque<u32> deque{4};
+  for (u32 i = 0; i < 1000; ++i) {
+    deque.push(i);
+  }
+  REQUIRE(deque.size() == 1000);
+
+  u32 value;
+  REQUIRE(deque.steal(value));
+  REQUIRE(value == 0);
+  REQUIRE(deque.pop(value));
+  REQUIRE(value == 999);
+  while (deque.pop(value)) {}
+  REQUIRE(value == 1);
+  REQUIRE_FALSE(deque.steal(value));
+}
+
+TEST_CASE("ThreadPool task storage", "[ThreadPool]") {
+  u32 counter = 0;
+  SECTION("Move only and oversized callables") {
+    struct big_t {
+      u64 data[16];
+    };
+    {
+      ntf::ThreadPool pool{2, ntf::POOL_WORK_STEALING};
+      ntf::UniquePtr<u32> value = ntf::make_unique<u32>(5u);
+      pool.enqueue([&counter, value = ntf::move(value)]() {
+        __atomic_add_fetch(&counter, *value, __ATOMIC_RELAXED);
+      });
+
+      big_t big{};
+      big.data[15] = 7;
+      static_assert(sizeof(big_t) > NTF_THREADPOOL_TASK_SIZE);
+      pool.enqueue([&counter, big]() {
+        __atomic_add_fetch(&counter, static_cast<u32>(big.data[15]), __ATOMIC_RELAXED);
+      });
+    }
+    REQUIRE(counter == 12);
+  }
+  SECTION("Overflowing the local task slots") {
+    {
+      ntf::ThreadPool pool{2, ntf::POOL_WORK_STEALING};
+      pool.enqueue([&pool, &counter]() {
+        for (u32 i = 0; i < 3 * NTF_THREADPOOL_LOCAL_TASKS; ++i) {
+          pool.enqueue([&counter]() { __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED); });
+        }
+      });
+    }
+    REQUIRE(counter == 3 * NTF_THREADPOOL_LOCAL_TASKS);
+  }
+}
+
+TEST_CASE("ThreadPool futures", "[ThreadPool]") {
+  ntf::ThreadPool pool{4, ntf::POOL_WORK_STEALING};
+
+  SECTION("Values and errors") {
+    auto value = pool.enqueue(ntf::with_future, []() { return 42u; });
+    auto none = pool.enqueue(ntf::with_future, []() {});
+    auto expected = pool.enqueue(ntf::with_future, []() -> ntf::Expected<u32, int> {
+      return ntf::unexpected<int>{-1};
+    });
+    auto thrown = pool.enqueue(ntf::with_future, []() -> u32 { throw 1; });
+
+    REQUIRE(*value.get() == 42u);
+    REQUIRE(none.get().has_value());
+    REQUIRE(expected.get().error() == -1);
+    REQUIRE(thrown.get().error() == ntf::TaskError::exception);
+  }
+  SECTION("Fan out and fan in") {
+    constexpr u32 count = 64;
+    ntf::Future<u32> futures[count];
+    for (u32 i = 0; i < count; ++i) {
+      futures[i] = pool.enqueue(ntf::with_future, [i]() { return i * i; });
+    }
+    REQUIRE(ntf::when_all(ntf::Span<ntf::Future<u32>>{futures, count}));
+
+    u32 sum = 0;
+    for (auto& future : futures) {
+      REQUIRE(future.ready());
+      sum += *future.get();
+    }
+    REQUIRE(sum == 85344);
+  }
+  SECTION("Waiting from a worker helps the pool") {
+    for (u32 flags : {ntf::POOL_SHARED_QUEUE, ntf::POOL_WORK_STEALING}) {
+      // A single worker deadlocks unless it runs the tasks it waits on
+      ntf::ThreadPool single{1, flags};
+      auto outer = single.enqueue(ntf::with_future, [&single]() {
+        auto inner = single.enqueue(ntf::with_future, []() { return 7u; });
+        ntf::Future<u32> more[4];
+        for (u32 i = 0; i < 4; ++i) {
+          more[i] = single.enqueue(ntf::with_future, [i]() { return i; });
+        }
+        ntf::when_all(ntf::Span<ntf::Future<u32>>{more, 4});
+        return *inner.get() + *more[3].get();
+      });
+      REQUIRE(*outer.get() == 10u);
+    }
+  }
+}
+
+TEST_CASE("ThreadPool parallel algorithms", "[ThreadPool]") {
+  constexpr size_t count = 100003;
+  ntf::ThreadPool pool{4, ntf::POOL_WORK_STEALING};
+  auto* values = new u32[count];
+
+  SECTION("parallel_for touches every element once") {
+    for (size_t i = 0; i < count; ++i) {
+      values[i] = static_cast<u32>(i);
+    }
+    ntf::parallel_for(pool, ntf::Span<u32>{values, count}, 0, [](u32& val) { val *= 2; });
+    bool all_doubled = true;
+    for (size_t i = 0; i < count; ++i) {
+      all_doubled &= values[i] == 2 * i;
+    }
+    REQUIRE(all_doubled);
+  }
+  SECTION("parallel_for blocks start on cache lines") {
+    u32 misaligned = 0;
+    ntf::parallel_for(pool, ntf::Span<u32>{values + 1, count - 1}, 100,
+                      [&](ntf::Span<u32> chunk) {
+      if (chunk.data() != values + 1 && reinterpret_cast<uintptr_t>(chunk.data()) % 64 != 0) {
+        __atomic_add_fetch(&misaligned, 1, __ATOMIC_RELAXED);
+      }
+    });
+    REQUIRE(misaligned == 0);
+  }
+  SECTION("parallel_reduce keeps the order") {
+    for (size_t i = 0; i < count; ++i) {
+      values[i] = 1;
+    }
+    const u64 sum = ntf::parallel_reduce(
+      pool, ntf::Span<u32>{values, count}, u64(5), [](u32 val) { return u64(val); },
+      [](u64 a, u64 b) { return a + b; });
+    REQUIRE(sum == count + 5);
+
+    // Taking the right hand side is associative but not commutative
+    for (size_t i = 0; i < count; ++i) {
+      values[i] = static_cast<u32>(i);
+    }
+    const u32 last = ntf::parallel_reduce(
+      pool, ntf::Span<u32>{values, count}, 0u, [](u32& val) { return val; },
+      [](u32, u32 b) { return b; }, 64);
+    REQUIRE(last == count - 1);
+  }
+  SECTION("Nested calls from workers") {
+    u32 total = 0;
+    auto outer = pool.enqueue(ntf::with_future, [&]() {
+      ntf::parallel_for(pool, ntf::Span<u32>{values, 1024}, 16, [&](u32&) {
+        __atomic_add_fetch(&total, 1, __ATOMIC_RELAXED);
+      });
+    });
+    outer.wait();
+    REQUIRE(total == 1024);
+  }
+  SECTION("Throwing on the caller waits for every block") {
+    // The caller always runs the first block itself
+    u32 touched = 0;
+    REQUIRE_THROWS_AS(ntf::parallel_for(pool, ntf::Span<u32>{values, count}, 64,
+                                        [&](ntf::Span<u32> chunk) {
+      if (chunk.data() == values) {
+        throw 1;
+      }
+      __atomic_add_fetch(&touched, static_cast<u32>(chunk.size()), __ATOMIC_RELAXED);
+    }),
+                      int);
+    const auto blocks = ntf::impl::ParallelBlocks::make(ntf::Span<u32>{values, count}, 64, 4);
+    REQUIRE(touched == count - blocks.end(0));
+
+    REQUIRE_THROWS_AS(ntf::parallel_reduce(
+                        pool, ntf::Span<u32>{values, count}, std::vector<u32>{},
+                        [&](u32& val) {
+      if (&val == values) {
+        throw 1;
+      }
+      return std::vector<u32>{val};
+    },
+                        [](std::vector<u32> a, std::vector<u32>) { return a; }, 64),
+                      int);
+  }
+  SECTION("parallel_reduce skips conflicting scratch arenas") {
+    ntf::ScratchArena outer;
+    const ntf_Arena conflict = outer.arena();
+    const auto caller = std::this_thread::get_id();
+    u8* caller_alloc = nullptr;
+    ntf::parallel_reduce(
+      pool, ntf::Span<u32>{values, count}, 0u,
+      [&](u32 val) {
+      if (std::this_thread::get_id() == caller && !caller_alloc) {
+        caller_alloc = static_cast<u8*>(outer.allocate(16, 1));
+        memset(caller_alloc, 0xAB, 16);
+      }
+      return val;
+    },
+      [](u32 a, u32 b) { return a + b; }, 0, ntf::Span<const ntf_Arena>{&conflict, 1});
+    REQUIRE(caller_alloc != nullptr);
+
+    // Would land on top of caller_alloc if the block results got rewound from under it
+    for (u32 i = 0; i < 4096; ++i) {
+      memset(outer.allocate(16, 1), 0, 16);
+    }
+    bool intact = true;
+    for (u32 i = 0; i < 16; ++i) {
+      intact &= caller_alloc[i] == 0xAB;
+    }
+    REQUIRE(intact);
+  }
+  delete[] values;
+}
+
+TEST_CASE("TaskGraph dependencies", "[TaskGraph]") {
+  ntf::ThreadPool pool{4, ntf::POOL_WORK_STEALING};
+  ntf::TaskGraph graph;
+
+  SECTION("Nodes run after their dependencies, every run") {
+    // Diamond: a -> (b, c) -> d
+    u32 order = 0;
+    u32 stamps[4]{};
+    auto stamp = [&](u32 idx) {
+      return [&, idx]() { stamps[idx] = __atomic_add_fetch(&order, 1, __ATOMIC_ACQ_REL); };
+    };
+    const auto a = graph.add_node(stamp(0));
+    const auto b = graph.add_node(stamp(1));
+    const auto c = graph.add_node(stamp(2));
+    const auto d = graph.add_node(stamp(3));
+    graph.add_edge(a, b);
+    graph.add_edge(a, c);
+    graph.add_edge(b, d);
+    graph.add_edge(c, d);
+
+    for (u32 run = 0; run < 100; ++run) {
+      order = 0;
+      graph.run(pool);
+      REQUIRE(stamps[0] == 1);
+      REQUIRE(stamps[3] == 4);
+    }
+  }
+  SECTION("Wide graphs") {
+    u32 counter = 0;
+    u32 seen_by_sink = 0;
+    const auto root = graph.add_node([]() {});
+    const auto sink = graph.add_node([&]() { seen_by_sink = counter; });
+    for (u32 i = 0; i < 256; ++i) {
+      const auto node =
+        graph.add_node([&]() { __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED); });
+      graph.add_edge(root, node);
+      graph.add_edge(node, sink);
+    }
+    graph.run(pool);
+    REQUIRE(counter == 256);
+    REQUIRE(seen_by_sink == 256);
+  }
+  SECTION("Cycles are rejected") {
+    const auto a = graph.add_node([]() {});
+    const auto b = graph.add_node([]() {});
+    graph.add_edge(a, b);
+    graph.add_edge(b, a);
+    REQUIRE_THROWS_AS(graph.run(pool), ntf::MsgException);
+  }
+}
+
+TEST_CASE("ThreadPool worker placement", "[ThreadPool]") {
+  const auto topology = ntf::cpu_topology();
+  REQUIRE(!topology.empty());
+
+  SECTION("CPU distances") {
+    const ntf::CpuInfo smt0{0, 0, 0, 0};
+    const ntf::CpuInfo smt1{1, 0, 0, 0};
+    const ntf::CpuInfo same_llc{2, 2, 0, 0};
+    const ntf::CpuInfo same_package{3, 3, 3, 0};
+    const ntf::CpuInfo remote{4, 4, 4, 1};
+    REQUIRE(ntf::cpu_distance(smt0, smt1) == 0);
+    REQUIRE(ntf::cpu_distance(smt0, same_llc) == 1);
+    REQUIRE(ntf::cpu_distance(smt0, same_package) == 2);
+    REQUIRE(ntf::cpu_distance(smt0, remote) == 3);
+  }
+  SECTION("Explicitly pinned workers") {
+    const u32 cpu = topology[0].id;
+    i32 wrong_cpu = 0;
+    {
+      ntf::ThreadPool pool{2, ntf::POOL_WORK_STEALING, {.cpus = ntf::Span<const u32>{&cpu, 1}}};
+      for (u32 i = 0; i < 64; ++i) {
+        pool.enqueue([&]() {
+          if (sched_getcpu() != static_cast<int>(cpu)) {
+            __atomic_add_fetch(&wrong_cpu, 1, __ATOMIC_RELAXED);
+          }
+        });
+      }
+    }
+    REQUIRE(wrong_cpu == 0);
+  }
+  SECTION("Topology placement") {
+    u32 counter = 0;
+    {
+      ntf::ThreadPool pool{4, ntf::POOL_WORK_STEALING | ntf::POOL_PIN_WORKERS};
+      ntf::parallel_for(pool, ntf::Span<const ntf::CpuInfo>{topology.data(), topology.size()}, 1,
+                        [&](const ntf::CpuInfo&) {
+        __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+      });
+    }
+    REQUIRE(counter == topology.size());
+  }
+}
+
+TEST_CASE("ThreadPool bulk enqueue", "[ThreadPool]") {
+  constexpr u32 task_count = 5000;
+  u32 counter = 0;
+  auto increment = [&counter]() { __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED); };
+
+  SECTION("Tasks from an external thread") {
+    auto* tasks = new ntf::ThreadPool::task_type[task_count];
+    for (u32 i = 0; i < task_count; ++i) {
+      tasks[i] = increment;
+    }
+    {
+      ntf::ThreadPool pool{4, ntf::POOL_WORK_STEALING, {.spin_count = 0, .yield_count = 0}};
+      pool.enqueue_bulk(ntf::Span<ntf::ThreadPool::task_type>{tasks, task_count});
+    }
+    REQUIRE(counter == task_count);
+    REQUIRE_FALSE(tasks[0]);
+    delete[] tasks;
+  }
+  SECTION("Callables from a worker, overflowing the local slots") {
+    constexpr u32 big_count = 2 * NTF_THREADPOOL_LOCAL_TASKS + 5;
+    struct increment_t {
+      u32* counter;
+
+      void operator()() const { __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED); }
+    };
+    auto* funcs = new increment_t[big_count];
+    for (u32 i = 0; i < big_count; ++i) {
+      funcs[i].counter = &counter;
+    }
+    {
+      ntf::ThreadPool pool{4, ntf::POOL_WORK_STEALING};
+      pool.enqueue([&]() { pool.enqueue_bulk(ntf::Span<increment_t>{funcs, big_count}); });
+    }
+    REQUIRE(counter == big_count);
+    delete[] funcs;
+  }
+}
+
+TEST_CASE("ThreadPool priorities", "[ThreadPool]") {
+  // A single worker blocked on a gate, so everything queues up before anything runs
+  u32 gate = 0;
+  u32 blocked = 0;
+  auto block = [&]() {
+    __atomic_store_n(&blocked, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&gate, __ATOMIC_ACQUIRE)) {
+      std::this_thread::yield();
+    }
+  };
+  u32 order[8]{};
+  u32 next = 0;
+  auto record = [&](u32 id) {
+    return [&, id]() { order[next++] = id; };
+  };
+  auto wait_blocked = [&blocked]() {
+    while (!__atomic_load_n(&blocked, __ATOMIC_ACQUIRE)) {
+      std::this_thread::yield();
+    }
+  };
+
+  SECTION("Deadlines first, then lanes from high to low") {
+    {
+      ntf::ThreadPool pool{1, ntf::POOL_SHARED_QUEUE, {.aging_ns = 0}};
+      pool.enqueue(block);
+      wait_blocked();
+      pool.enqueue(ntf::TaskPriority::low, record(5));
+      pool.enqueue(ntf::TaskPriority::normal, record(4));
+      pool.enqueue(ntf::TaskPriority::high, record(3));
+      const u64 now = ntf::monotonic_ns();
+      pool.enqueue_deadline(now + 2000, record(2));
+      pool.enqueue_deadline(now + 1000, record(1));
+      __atomic_store_n(&gate, 1, __ATOMIC_RELEASE);
+    }
+    REQUIRE(next == 5);
+    for (u32 i = 0; i < 5; ++i) {
+      REQUIRE(order[i] == i + 1);
+    }
+  }
+  SECTION("Old low priority tasks climb over new ones") {
+    {
+      ntf::ThreadPool pool{1, ntf::POOL_SHARED_QUEUE, {.aging_ns = 1'000'000}};
+      pool.enqueue(block);
+      wait_blocked();
+      pool.enqueue(ntf::TaskPriority::low, record(1));
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      pool.enqueue(ntf::TaskPriority::high, record(2));
+      __atomic_store_n(&gate, 1, __ATOMIC_RELEASE);
+    }
+    REQUIRE(next == 2);
+    REQUIRE(order[0] == 1);
+    REQUIRE(order[1] == 2);
+  }
+  SECTION("Local work doesn't starve the lanes") {
+    constexpr u32 max_steps = 1'000'000;
+    // Keeps the worker deque non empty until the low priority task runs
+    struct respawn_t {
+      ntf::ThreadPool* pool;
+      u32* steps;
+      u32* low_ran;
+
+      void operator()() const {
+        if (__atomic_load_n(low_ran, __ATOMIC_ACQUIRE) ||
+            __atomic_add_fetch(steps, 1, __ATOMIC_RELAXED) >= max_steps) {
+          return;
+        }
+        pool->enqueue(*this);
+      }
+    };
+    u32 steps = 0;
+    u32 low_ran = 0;
+    {
+      ntf::ThreadPool pool{1, ntf::POOL_WORK_STEALING};
+      pool.enqueue(respawn_t{&pool, &steps, &low_ran});
+      while (!__atomic_load_n(&steps, __ATOMIC_RELAXED)) {
+        std::this_thread::yield();
+      }
+      pool.enqueue(ntf::TaskPriority::low,
+                   [&low_ran]() { __atomic_store_n(&low_ran, 1, __ATOMIC_RELEASE); });
+    }
+    REQUIRE(low_ran == 1);
+    REQUIRE(steps < max_steps);
+  }
+  SECTION("Without aging low tasks wait for local normal work") {
+    constexpr u32 normal_count = 500;
+    u32 normal_done = 0;
+    u32 seen_by_low = 0;
+    {
+      ntf::ThreadPool pool{1, ntf::POOL_WORK_STEALING, {.aging_ns = 0}};
+      pool.enqueue([&]() {
+        pool.enqueue(ntf::TaskPriority::low, [&]() {
+          __atomic_store_n(&seen_by_low, __atomic_load_n(&normal_done, __ATOMIC_RELAXED),
+                           __ATOMIC_RELAXED);
+        });
+        for (u32 i = 0; i < normal_count; ++i) {
+          pool.enqueue(
+            [&normal_done]() { __atomic_add_fetch(&normal_done, 1, __ATOMIC_RELAXED); });
+        }
+      });
+    }
+    REQUIRE(seen_by_low == normal_count);
+  }
+}
+
+TEST_CASE("TimerWheel", "[TimerWheel]") {
+  u32 fired = 0;
+  u32 early = 0;
+  auto wait_fired = [&fired](u32 count) {
+    for (u32 i = 0; i < 5000 && __atomic_load_n(&fired, __ATOMIC_ACQUIRE) < count; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  };
+  auto check = [&](u64 deadline) {
+    return [&fired, &early, deadline]() {
+      if (ntf::monotonic_ns() < deadline) {
+        __atomic_add_fetch(&early, 1, __ATOMIC_RELAXED);
+      }
+      __atomic_add_fetch(&fired, 1, __ATOMIC_ACQ_REL);
+    };
+  };
+
+  SECTION("Timers fire in order, never early") {
+    ntf::ThreadPool pool{1};
+    ntf::TimerWheel wheel{pool};
+    u32 order[3]{};
+    u32 next = 0;
+    const u64 now = ntf::monotonic_ns();
+    const u64 delays[3] = {30'000'000, 10'000'000, 20'000'000};
+    for (u32 i = 0; i < 3; ++i) {
+      wheel.schedule_at(now + delays[i], [&, i, deadline = now + delays[i]]() {
+        order[next++] = i;
+        check(deadline)();
+      });
+    }
+    wait_fired(3);
+    REQUIRE(fired == 3);
+    REQUIRE(early == 0);
+    REQUIRE(order[0] == 1);
+    REQUIRE(order[1] == 2);
+    REQUIRE(order[2] == 0);
+    REQUIRE(wheel.size() == 0);
+  }
+  SECTION("Cancelled timers don't run") {
+    ntf::ThreadPool pool{1};
+    ntf::TimerWheel wheel{pool};
+    const auto kept = wheel.schedule(5'000'000, check(0));
+    const auto cancelled = wheel.schedule(5'000'000, check(0));
+    REQUIRE(wheel.cancel(cancelled));
+    REQUIRE_FALSE(wheel.cancel(cancelled));
+    REQUIRE_FALSE(wheel.cancel(ntf::TimerWheel::null_timer));
+    wait_fired(1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    REQUIRE(fired == 1);
+    REQUIRE_FALSE(wheel.cancel(kept));
+  }
+  SECTION("Many timers cascading through the levels") {
+    constexpr u32 timer_count = 100'000;
+    ntf::ThreadPool pool{2, ntf::POOL_WORK_STEALING};
+    // 100us ticks, 200ms spans a few turns of the second level
+    ntf::TimerWheel wheel{pool, 100'000};
+    const u64 now = ntf::monotonic_ns();
+    u32 cancelled = 0;
+    for (u32 i = 0; i < timer_count; ++i) {
+      const u64 deadline = now + (i * 7919ull) % 200'000'000;
+      const auto timer = wheel.schedule_at(deadline, check(deadline));
+      if (i % 2) {
+        cancelled += wheel.cancel(timer);
+      }
+    }
+    wait_fired(timer_count - cancelled);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    REQUIRE(cancelled > timer_count / 4);
+    REQUIRE(fired == timer_count - cancelled);
+    REQUIRE(early == 0);
+    REQUIRE(wheel.size() == 0);
+  }
+}
+
+TEST_CASE("ThreadPool stats", "[ThreadPool]") {
+  SECTION("Histogram percentiles") {
+    u64 hist[ntf::ThreadPoolStats::HIST_BUCKETS]{};
+    REQUIRE(ntf::ThreadPoolStats::percentile(hist, 0.5) == 0);
+    hist[3] = 90;
+    hist[10] = 10;
+    REQUIRE(ntf::ThreadPoolStats::percentile(hist, 0.5) == 15);
+    REQUIRE(ntf::ThreadPoolStats::percentile(hist, 0.9) == 15);
+    REQUIRE(ntf::ThreadPoolStats::percentile(hist, 0.99) == 2047);
+  }
+  SECTION("Backlog") {
+    u32 gate = 0;
+    u32 blocked = 0;
+    {
+      ntf::ThreadPool pool{1};
+      pool.enqueue([&]() {
+        __atomic_store_n(&blocked, 1, __ATOMIC_RELEASE);
+        while (!__atomic_load_n(&gate, __ATOMIC_ACQUIRE)) {
+          std::this_thread::yield();
+        }
+      });
+      while (!__atomic_load_n(&blocked, __ATOMIC_ACQUIRE)) {
+        std::this_thread::yield();
+      }
+      for (u32 i = 0; i < 3; ++i) {
+        pool.enqueue([]() {});
+      }
+      REQUIRE(pool.stats().backlog == 3);
+      __atomic_store_n(&gate, 1, __ATOMIC_RELEASE);
+    }
+  }
+#ifdef NTF_THREADPOOL_STATS
+  SECTION("Counters add up") {
+    constexpr u32 task_count = 512;
+    ntf::ThreadPool pool{2, ntf::POOL_WORK_STEALING};
+    pool.enqueue([&pool]() {
+      for (u32 i = 1; i < task_count; ++i) {
+        pool.enqueue([]() {});
+      }
+    });
+    // Runs are counted right after each task returns
+    ntf::ThreadPoolStats stats = pool.stats();
+    for (u32 i = 0; i < 5000 && stats.executed < task_count; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      stats = pool.stats();
+    }
+    REQUIRE(stats.executed == task_count);
+    REQUIRE(stats.backlog == 0);
+    u64 waits = 0;
+    u64 runs = 0;
+    for (u32 i = 0; i < ntf::ThreadPoolStats::HIST_BUCKETS; ++i) {
+      waits += stats.wait_hist[i];
+      runs += stats.run_hist[i];
+    }
+    REQUIRE(waits == task_count);
+    REQUIRE(runs == task_count);
+    REQUIRE(pool.worker_stats(0).executed + pool.worker_stats(1).executed == task_count);
+    REQUIRE(stats.busy_ns > 0);
+  }
+  SECTION("Tasks run while waiting aren't counted twice") {
+    ntf::ThreadPool single{1};
+    single.enqueue([&single]() {
+      auto inner = single.enqueue(ntf::with_future, []() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      });
+      inner.wait();
+    });
+    ntf::ThreadPoolStats stats = single.stats();
+    for (u32 i = 0; i < 5000 && stats.executed < 2; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      stats = single.stats();
+    }
+    REQUIRE(stats.executed == 2);
+    REQUIRE(stats.busy_ns >= 50'000'000);
+    REQUIRE(stats.busy_ns < 90'000'000);
+  }
+#endif
+}
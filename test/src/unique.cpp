@@ -191,3 +191,21 @@ TEST_CASE("UniqueArray reset", "[UniqueArray]") {
     REQUIRE(arr1.size() == count2);
   }
 }
+
+TEST_CASE("UniquePtr with SlabPool", "[UniquePtr]") {
+  ntf::SlabPool pool;
+  int* first_ptr;
+  {
+    auto first = ntf::make_unique<int>(ntf::alloc_arg, pool, 4);
+    REQUIRE(*first == 4);
+    first_ptr = first.get();
+  }
+  auto second = ntf::make_unique<int>(ntf::alloc_arg, pool, 8);
+  REQUIRE(second.get() == first_ptr);
+
+  auto arr = ntf::make_unique_array<int>(ntf::alloc_arg, pool, 16, 2);
+  REQUIRE(arr.size() == 16);
+  for (const int n : arr) {
+    REQUIRE(n == 2);
+  }
+}